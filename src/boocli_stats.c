@@ -0,0 +1,128 @@
+/** @file boocli_stats.c
+ *
+ * @brief Reader of the timing statistics published by boocli in a shared memory block (see stats.c; "stats = true" in config file).
+ * It prints the time of each stage of the process callback (min, average, max, and histogram), the load of the cycle,
+ * and the last xruns with the worst times of the stages before them.
+ * usage: boocli_stats [interval] : print once, or every interval seconds
+ *
+ */
+
+#include "types.h"
+#include <fcntl.h>
+
+
+// names of the stages
+static const char *stage_names [LAST_STAGE] = {"cycle", "command", "midi", "play", "record", "clip", "led"};
+
+
+// get a consistent copy of the statistics: realtime thread may be writing the block; returns 0 if no copy could be done
+static int read_stats (volatile stats_t *shared, stats_t *copy) {
+
+	unsigned int sequence;
+	int retry;
+
+	for (retry = 0; retry < 100; retry++) {
+		sequence = shared->sequence;
+		__sync_synchronize ();
+		memcpy (copy, (const void *) shared, sizeof (stats_t));
+		__sync_synchronize ();
+		if (((sequence & 1) == 0) && (sequence == shared->sequence)) return 1;
+		usleep (100);
+	}
+
+	return 0;
+}
+
+
+// print the statistics
+static void print_stats (stats_t *s) {
+
+	stage_stats_t *st;
+	xrun_stats_t *x;
+	double period = 1000000.0 * s->nframes / s->sample_rate;		// length of a cycle, in us
+	int i, j, last, first;
+	char label [16];
+
+	printf ("%u Hz, %u frames per cycle (%.0f us), %u tracks; %llu cycles, %u tracks active (max %u), %u xruns\n",
+		s->sample_rate, s->nframes, period, s->nb_tracks, s->cycles, s->tracks, s->tracks_max, s->xruns);
+	if (s->cycles == 0) return;
+
+	// min, average, max of each stage, in us and in % of the cycle
+	printf ("\n%-8s %9s %9s %9s %9s %7s %7s\n", "stage", "last us", "min us", "avg us", "max us", "avg %", "max %");
+	for (i = FIRST_STAGE; i < LAST_STAGE; i++) {
+		st = &s->stage [i];
+		printf ("%-8s %9.1f %9.1f %9.1f %9.1f %7.1f %7.1f\n", stage_names [i], st->last / 1000.0, st->min / 1000.0,
+			st->sum / 1000.0 / s->cycles, st->max / 1000.0, st->sum / 10.0 / s->cycles / period, st->max / 10.0 / period);
+	}
+
+	// histograms: number of cycles for each range of time
+	printf ("\n%-14s", "histogram us");
+	for (j = 0; j < STATS_BINS - 1; j++) {
+		snprintf (label, sizeof (label), "<%d", 2 << j);
+		printf (" %8s", label);
+	}
+	snprintf (label, sizeof (label), ">=%d", 1 << (STATS_BINS - 1));
+	printf (" %8s\n", label);
+	for (i = FIRST_STAGE; i < LAST_STAGE; i++) {
+		st = &s->stage [i];
+		printf ("%-14s", stage_names [i]);
+		for (j = 0; j < STATS_BINS; j++) printf (" %8u", st->histogram [j]);
+		printf ("\n");
+	}
+
+	// last xruns, with the worst times of the stages before them
+	if (s->xruns == 0) return;
+	last = s->xruns - 1;
+	first = (s->xruns > STATS_XRUNS) ? s->xruns - STATS_XRUNS : 0;
+	printf ("\nxruns: worst times (us) of the stages before the xrun\n");
+	printf ("%-12s %9s", "cycle", "delay us");
+	for (i = FIRST_STAGE; i < LAST_STAGE; i++) printf (" %8s", stage_names [i]);
+	printf ("\n");
+	for (j = first; j <= last; j++) {
+		x = &s->xrun [j % STATS_XRUNS];
+		printf ("%-12llu %9.1f", x->cycle, x->delay);
+		for (i = FIRST_STAGE; i < LAST_STAGE; i++) printf (" %8.1f", x->worst [i] / 1000.0);
+		printf ("\n");
+	}
+}
+
+
+int main (int argc, char *argv []) {
+
+	volatile stats_t *shared;
+	stats_t copy;
+	int fd, interval = 0;
+
+	if (argc > 1) interval = atoi (argv [1]);
+
+	fd = shm_open (STATS_SHM, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf ( stderr, "Cannot open stats block %s (%s): is boocli running, with stats = true in config file ?\n", STATS_SHM, strerror (errno) );
+		exit ( 1 );
+	}
+	shared = mmap (NULL, sizeof (stats_t), PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (shared == MAP_FAILED) {
+		fprintf ( stderr, "Cannot map stats block %s (%s).\n", STATS_SHM, strerror (errno) );
+		exit ( 1 );
+	}
+	if ((shared->magic != STATS_MAGIC) || (shared->version != STATS_VERSION)) {
+		fprintf ( stderr, "Stats block %s is not from this version of boocli.\n", STATS_SHM );
+		exit ( 1 );
+	}
+
+	do {
+		if (!read_stats (shared, &copy)) {
+			fprintf ( stderr, "Cannot read stats block %s.\n", STATS_SHM );
+			exit ( 1 );
+		}
+		print_stats (&copy);
+		if (interval > 0) {
+			printf ("\n");
+			fflush (stdout);
+			sleep (interval);
+		}
+	} while (interval > 0);
+
+	return 0;
+}
@@ -0,0 +1,548 @@
+/** @file clock.c
+ *
+ * @brief Clock sources: the clock events of each cycle (midi clock ticks, start, stop) are taken from a clock source.
+ * With midi clock, these are the events of the active clock input port: the primary input while it is good (regular ticks, low jitter),
+ * otherwise another input which is ticking (failover). If all the inputs are lost while the clock is running, it goes on at the
+ * last tempo (freewheel), so loops go on. Ticks missed while switching from an input to another are caught up, so bars stay in place.
+ * With JACK transport, these are computed from the
+ * position of the transport (bars, beats and ticks given by the timebase master), so ticks are on their exact frame.
+ * boocli can also be the timebase master of the transport, at a fixed tempo (see bpm in config file).
+ * With the internal clock, ticks are computed from the frames elapsed since the start, at the tempo given by bpm or by the tap pad.
+ * The clock events are also sent on the clock output port, on their exact frame, so other gear can follow boocli.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "led.h"
+#include "time.h"
+#include "utils.h"
+#include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
+
+
+// midi clock: clock inputs, and active input (or CLOCK_FREEWHEEL)
+static clock_input_t clock_inputs [CLOCK_INPUTS];
+static int clock_active = CLOCK_FREEWHEEL;
+static int is_running = FALSE;				// TRUE if the clock is running (ticks of the active input, or freewheel)
+static int is_switched = FALSE;				// TRUE if the active input has changed: missed ticks are caught up at its first tick
+static jack_midi_event_t clock_pending;		// tick of the active input, sent once missed ticks are caught up
+static int is_pending = FALSE;
+static int catchup = 0;						// number of missed ticks to be sent before the pending tick
+static double catchup_spt;					// number of frames per tick of the missed ticks
+static jack_nframes_t free_start;			// freewheel: absolute frame time of the last tick before freewheel
+static double free_spt;						// freewheel: number of frames per tick (last tempo)
+static int free_ticks;						// freewheel: number of ticks sent since the last tick before freewheel
+
+// clock output: the clock events of the cycle are copied to the clock output port
+static void *clock_out;
+static jack_nframes_t clock_frame;			// absolute frame time of the start of the cycle
+static jack_nframes_t tick_last;			// absolute frame time of the last tick sent to the looper (nominal time, for missed ticks)
+
+// JACK transport and internal clock: clock ticks are numbered from the start of the transport (tick k is at k / ppbar whole notes)
+static jack_midi_data_t clock_data [1];		// buffer of the clock events made by boocli (transport, internal clock, freewheel)
+static jack_nframes_t clock_nframes;		// number of frames of the cycle
+static int is_ticking = FALSE;				// TRUE if clock ticks are made from the transport during this cycle
+static int is_rolling = FALSE;				// TRUE if transport was rolling during the previous cycle
+static int is_bar_wait = FALSE;				// TRUE if transport has been started (or moved): midi play is sent at the next bar of the transport
+static int is_stop = FALSE;					// TRUE if transport has been stopped: midi stop is sent
+static int is_stop_request = FALSE;			// TRUE if main thread has asked the internal clock to stop
+static double tick_position;				// position of the transport at the start of the cycle, in ticks
+static double tick_frames;					// number of frames per tick
+static long long tick_next;					// next tick to be sent
+static long long bar_ticks;					// number of ticks of a bar of the transport, in 1/beat_type ticks
+static int beat_type;						// denominator of the time signature of the transport
+
+// tempo of the internal clock and of the timebase master, in quarter notes per minute: it is owned by the process callback (tap pad),
+// and published once per cycle to the timebase callback, which gets its own copy
+static double clock_bpm;
+static double timebase_bpm;
+
+// tap pad: frame of the last tap, and last intervals between taps
+static jack_nframes_t tap_frame;
+static jack_nframes_t tap_intervals [TAP_COUNT];
+static int tap_count = -1;					// number of intervals since the first tap of the series (-1 before the first tap)
+
+
+// read transport position at the start of the cycle (clock_nframes is still the number of frames of the previous cycle)
+// clock ticks are made from the transport if it is rolling, and gives bars and beats
+static void transport_start () {
+
+	jack_position_t pos;
+	int rolling;
+	double position;
+
+	rolling = (jack_transport_query (client, &pos) == JackTransportRolling);
+	if (!rolling || !(pos.valid & JackPositionBBT) || (pos.beats_per_minute <= 0.0) || (pos.beat_type <= 0.0) || (pos.beats_per_bar <= 0.0) || (pos.ticks_per_beat <= 0.0)) {
+		if (is_rolling) is_stop = TRUE;
+		is_rolling = FALSE;
+		is_ticking = FALSE;
+		return;
+	}
+
+	// position in clock ticks: beats of the transport are 1/beat_type notes
+	position = ((((pos.bar - 1) * (double) pos.beats_per_bar) + (pos.beat - 1) + (pos.tick / pos.ticks_per_beat)) * ppbar) / pos.beat_type;
+
+	// transport has been started, or moved to another position: loops restart at next bar of the transport, in its time signature
+	// otherwise, position follows the frames of the previous cycle, as ticks of the transport are rounded
+	if (!is_rolling || (fabs (position - tick_position - (clock_nframes / tick_frames)) > 0.5)) {
+		is_bar_wait = TRUE;
+		tick_next = (long long) ceil (position - 1e-6);
+	}
+	else position = tick_position + (clock_nframes / tick_frames);
+
+	beat_type = (int) floor (pos.beat_type + 0.5);
+	bar_ticks = (long long) floor ((ppbar * (double) pos.beats_per_bar) + 0.5);
+	tick_frames = (pos.frame_rate * 60.0 * pos.beat_type) / (pos.beats_per_minute * ppbar);
+	tick_position = position;
+	is_rolling = TRUE;
+	is_ticking = TRUE;
+}
+
+
+// internal clock: position follows the frames of the previous cycle, at the tempo of the previous cycle; it starts with midi play at the first cycle
+// the tempo of the cycle is then taken: so a new tempo (tap pad) applies from the position of the clock, without any jump
+static void internal_start () {
+
+	if (!is_rolling) {
+		is_rolling = TRUE;
+		is_ticking = TRUE;
+		is_bar_wait = TRUE;
+		tick_position = 0.0;
+		tick_next = 0;
+	}
+	else tick_position += clock_nframes / tick_frames;
+
+	// internal clock has been stopped: midi stop is sent, and clock does not tick anymore
+	if (is_ticking && __atomic_load_n (&is_stop_request, __ATOMIC_ACQUIRE)) {
+		is_stop = TRUE;
+		is_ticking = FALSE;
+	}
+
+	// bpm are quarter notes per minute (24 ticks per quarter note with the default ppbar)
+	tick_frames = (sample_rate * 60.0 * 4.0) / (clock_bpm * ppbar);
+}
+
+
+// copy a clock event of the cycle to the clock output port (only clock, start, continue, stop and song position pointer)
+static int clock_send (jack_midi_event_t *event) {
+
+	if ((event->size == 1) && (event->buffer [0] >= MIDI_CLOCK)) jack_midi_event_write (clock_out, event->time, event->buffer, 1);
+	if ((event->size == 3) && (event->buffer [0] == MIDI_SPP)) jack_midi_event_write (clock_out, event->time, event->buffer, 3);
+	return 1;
+}
+
+
+// TRUE if a clock input is ticking: it is lost if it has not ticked for CLOCK_DROPOUT ticks (or CLOCK_TIMEOUT if its tempo is not known)
+static int input_alive (clock_input_t *in, jack_nframes_t now) {
+
+	double timeout;
+
+	if (in->state != INPUT_RUNNING) return FALSE;
+	timeout = tempo_locked (&in->tempo) ? CLOCK_DROPOUT * tempo_spt (&in->tempo) : CLOCK_TIMEOUT * sample_rate;
+	return ((jack_nframes_t) (now - in->frame) <= timeout);
+}
+
+
+// TRUE if a clock input is good: regular ticks for a while, and low jitter
+static int input_good (clock_input_t *in, jack_nframes_t now) {
+
+	return (input_alive (in, now) && (in->ticks >= CLOCK_RECOVER) && (in->jitter <= CLOCK_JITTER * tempo_spt (&in->tempo)));
+}
+
+
+// select the active clock input at the start of the cycle: primary input if it is good, otherwise the active input if it is good,
+// otherwise any good input, otherwise any input which is ticking (and whose tempo is known); if none, clock goes on in freewheel
+static void input_select () {
+
+	int i, best = CLOCK_FREEWHEEL;
+	clock_input_t *in;
+
+	// lost inputs start again from scratch when these tick again
+	for (i = 0; i < nb_clock_inputs; i++) {
+		in = &clock_inputs [i];
+		if ((in->state == INPUT_RUNNING) && !input_alive (in, clock_frame)) {
+			in->state = INPUT_IDLE;
+			tempo_reset (&in->tempo);
+			in->ticks = 0;
+		}
+	}
+
+	// active input has been stopped: it remains the active input until play is received (from any input)
+	if ((clock_active != CLOCK_FREEWHEEL) && (clock_inputs [clock_active].state == INPUT_STOPPED)) return;
+
+	if (input_good (&clock_inputs [clock_primary], clock_frame)) best = clock_primary;
+	else if ((clock_active != CLOCK_FREEWHEEL) && input_good (&clock_inputs [clock_active], clock_frame)) best = clock_active;
+	else {
+		for (i = 0; (i < nb_clock_inputs) && (best == CLOCK_FREEWHEEL); i++) if (input_good (&clock_inputs [i], clock_frame)) best = i;
+		if ((best == CLOCK_FREEWHEEL) && (clock_active != CLOCK_FREEWHEEL) && input_alive (&clock_inputs [clock_active], clock_frame)) best = clock_active;
+		for (i = 0; (i < nb_clock_inputs) && (best == CLOCK_FREEWHEEL); i++) {
+			if (input_alive (&clock_inputs [i], clock_frame) && tempo_locked (&clock_inputs [i].tempo)) best = i;
+		}
+	}
+
+	if (best == clock_active) return;
+
+	// all inputs are lost: clock goes on at the last tempo, from the last tick
+	if (best == CLOCK_FREEWHEEL) {
+		free_spt = tempo_spt (&tempo);
+		if (is_running && (free_spt > 0.0)) {
+			free_start = tick_last;
+			free_ticks = 0;
+			logger_send (LOG_FREEWHEEL, 0, tempo_bpm (&tempo), NULL);
+		}
+		else is_running = FALSE;
+	}
+	else logger_send (LOG_CLOCK_INPUT, best, 0.0, NULL);
+
+	clock_active = best;
+	is_switched = is_running;
+}
+
+
+// watch an event of a clock input; returns TRUE if the event goes to the looper (event of the active input)
+static int input_event (int i, jack_midi_event_t *event) {
+
+	clock_input_t *in = &clock_inputs [i];
+	jack_nframes_t frame = clock_frame + event->time;
+	double e;
+
+	switch (event->buffer [0]) {
+
+		// tick: measure tempo and jitter of the input (an input may tick while it is stopped)
+		case MIDI_CLOCK:
+			if (in->state == INPUT_IDLE) {
+				in->state = INPUT_RUNNING;
+				tempo_reset (&in->tempo);
+				in->jitter = 0.0;
+			}
+			if (tempo_locked (&in->tempo)) {
+				e = (double) (int32_t) (frame - tempo_predict (&in->tempo, 1));
+				in->jitter += (fabs (e) - in->jitter) * CLOCK_SMOOTH;
+			}
+			tempo_tick (&in->tempo, frame);
+			in->ticks = tempo_locked (&in->tempo) ? in->ticks + 1 : 0;
+			in->frame = frame;
+			return (i == clock_active);
+
+		// play (or continue): input becomes the active input if clock is not running (otherwise it goes on with the active input)
+		case MIDI_PLAY:
+		case MIDI_CONTINUE:
+			in->state = INPUT_RUNNING;
+			tempo_reset (&in->tempo);
+			in->ticks = 0;
+			in->jitter = 0.0;
+			in->frame = frame;
+			if (is_running && (i != clock_active)) return FALSE;
+			if (i != clock_active) logger_send (LOG_CLOCK_INPUT, i, 0.0, NULL);
+			clock_active = i;
+			is_running = TRUE;
+			is_switched = FALSE;
+			return TRUE;
+
+		// stop: clock stops if this is the active input (or in freewheel: the lost input has come back to stop)
+		case MIDI_STOP:
+			in->state = INPUT_STOPPED;
+			tempo_reset (&in->tempo);
+			in->ticks = 0;
+			if ((i != clock_active) && ((clock_active != CLOCK_FREEWHEEL) || !is_running)) return FALSE;
+			is_running = FALSE;
+			return TRUE;
+	}
+
+	return (i == clock_active);
+}
+
+
+// next event of all the clock inputs, in time order (events are not consumed); returns the input, or -1 if there is no more event
+static int input_peek (jack_midi_event_t *event) {
+
+	jack_midi_event_t in_event;
+	clock_input_t *in;
+	int i, next = -1;
+
+	for (i = 0; i < nb_clock_inputs; i++) {
+		in = &clock_inputs [i];
+		while (in->index < in->count) {
+			if (jack_midi_event_get (&in_event, in->buffer, in->index) == 0) {
+				if ((next < 0) || (in_event.time < event->time)) {
+					*event = in_event;
+					next = i;
+				}
+				break;
+			}
+			logger_send (LOG_MISSED_CLOCK, 0, 0.0, NULL);
+			in->index++;
+		}
+	}
+
+	return next;
+}
+
+
+// a clock tick goes to the looper (synthetic tick of freewheel, or tick of the active input); frame is its nominal time
+static int clock_tick (jack_midi_event_t *event, jack_nframes_t frame) {
+
+	tick_last = frame;
+	if ((clock_active == CLOCK_FREEWHEEL) || (clock_inputs [clock_active].state != INPUT_STOPPED)) is_running = TRUE;
+	return clock_send (event);
+}
+
+
+// next clock event of the midi clock inputs
+static int midi_next (jack_midi_event_t *event) {
+
+	jack_midi_event_t in_event;
+	jack_nframes_t free_frame;
+	int32_t free_time;
+	int i, missed;
+	double spt;
+
+	// missed ticks are sent after a switch of input, then the tick of the active input
+	if (catchup > 0) {
+		catchup--;
+		*event = clock_pending;
+		event->buffer = clock_data;
+		event->size = 1;
+		clock_data [0] = MIDI_CLOCK;
+		return clock_tick (event, tick_last + (jack_nframes_t) floor (catchup_spt + 0.5));
+	}
+	if (is_pending) {
+		is_pending = FALSE;
+		*event = clock_pending;
+		return clock_tick (event, clock_frame + event->time);
+	}
+
+	while (1) {
+		i = input_peek (&in_event);
+
+		// freewheel: ticks at the last tempo (in time order with the events of the inputs, as a lost input may send stop)
+		if ((clock_active == CLOCK_FREEWHEEL) && is_running) {
+			free_frame = free_start + (jack_nframes_t) floor (((free_ticks + 1) * free_spt) + 0.5);
+			free_time = (int32_t) (free_frame - clock_frame);
+			if (free_time < 0) free_time = 0;
+			if ((free_time < (int32_t) clock_nframes) && ((i < 0) || (free_time <= (int32_t) in_event.time))) {
+				free_ticks++;
+				event->time = free_time;
+				event->buffer = clock_data;
+				event->size = 1;
+				clock_data [0] = MIDI_CLOCK;
+				return clock_tick (event, free_frame);
+			}
+		}
+
+		if (i < 0) return 0;
+		clock_inputs [i].index++;
+		*event = in_event;
+		if (!input_event (i, event)) continue;
+		if (event->buffer [0] != MIDI_CLOCK) return clock_send (event);
+
+		// first tick of a new active input: ticks missed since the last tick are caught up (or tick is dropped, if it is the same as the last tick)
+		if (is_switched) {
+			is_switched = FALSE;
+			spt = (tempo_spt (&tempo) > 0.0) ? tempo_spt (&tempo) : tempo_spt (&clock_inputs [i].tempo);
+			if (spt > 0.0) {
+				missed = (int) floor (((jack_nframes_t) (clock_frame + event->time - tick_last) / spt) + 0.5) - 1;
+				if (missed < 0) continue;
+				if (missed > 0) {
+					catchup = (missed > ppbar) ? ppbar : missed;
+					catchup_spt = spt;
+					clock_pending = *event;
+					is_pending = TRUE;
+					return midi_next (event);
+				}
+			}
+		}
+		return clock_tick (event, clock_frame + event->time);
+	}
+}
+
+
+// time (in the cycle) of the next clock tick of the transport (or of the internal clock)
+static double transport_time () {
+
+	return (tick_next - tick_position) * tick_frames;
+}
+
+
+/**************************************/
+/* functions for the realtime thread  */
+/**************************************/
+
+// called at the start of each cycle, before the clock events of the cycle are read with clock_next
+void clock_start (jack_nframes_t nframes) {
+
+	int i;
+
+	clock_out = jack_port_get_buffer (clock_output_port, nframes);
+	jack_midi_clear_buffer (clock_out);
+	clock_frame = jack_last_frame_time (client);
+
+	if (clock_source != CLOCK_MIDI) {
+		if (clock_source == CLOCK_TRANSPORT) transport_start ();
+		else internal_start ();
+		clock_nframes = nframes;
+		// tempo for the timebase callback
+		__atomic_store (&timebase_bpm, &clock_bpm, __ATOMIC_RELEASE);
+		return;
+	}
+
+	for (i = 0; i < nb_clock_inputs; i++) {
+		clock_inputs [i].buffer = jack_port_get_buffer (clock_input_ports [i], nframes);
+		clock_inputs [i].index = 0;
+		clock_inputs [i].count = jack_midi_get_event_count (clock_inputs [i].buffer);
+	}
+	clock_nframes = nframes;
+	input_select ();
+}
+
+
+// get next clock event of the cycle, in time order; returns 0 if there is no more clock event in the cycle
+int clock_next (jack_midi_event_t *event) {
+
+	double time;
+	int value;
+
+	if (clock_source == CLOCK_MIDI) return midi_next (event);
+
+	event->buffer = clock_data;
+	event->size = 1;
+
+	// transport (or internal clock) has been stopped
+	if (is_stop) {
+		is_stop = FALSE;
+		event->time = 0;
+		clock_data [0] = MIDI_STOP;
+		return clock_send (event);
+	}
+
+	if (!is_ticking) return 0;
+	time = transport_time ();
+	if (time >= clock_nframes) return 0;
+	event->time = (time > 0.0) ? (jack_nframes_t) floor (time) : 0;
+
+	// first bar of the transport after a start: midi play, then the tick (which is then the first tick of a bar)
+	// internal clock starts with midi play, in the current time signature
+	// time signature of the transport is used if it is in the list (the tick table is built only when it changes); otherwise current one is kept
+	if (is_bar_wait && ((clock_source == CLOCK_INTERNAL) || (((tick_next * beat_type) % bar_ticks) == 0))) {
+		is_bar_wait = FALSE;
+		if ((clock_source == CLOCK_TRANSPORT) && (((int) (bar_ticks / ppbar) != BBT_numerator) || (beat_type != BBT_denominator))) {
+			value = lookup_timesign ((int) (bar_ticks / ppbar), beat_type);
+			if (value >= 0) set_timesign (value);
+		}
+		clock_data [0] = MIDI_PLAY;
+		return clock_send (event);
+	}
+
+	clock_data [0] = MIDI_CLOCK;
+	tick_next++;
+	tick_last = clock_frame + event->time;
+	return clock_send (event);
+}
+
+
+// absolute frame time of the last clock tick: this is its nominal time, when the tick has been sent late (ticks missed while switching clock inputs)
+jack_nframes_t clock_tick_frame () {
+
+	return tick_last;
+}
+
+
+// tap pad has been pressed at absolute frame time: tempo of the internal clock is the average of the last intervals between taps
+// a tap more than a beat at MIN_BPM after the previous one starts a new series of taps
+void clock_tap (jack_nframes_t time) {
+
+	jack_nframes_t interval;
+	double sum;
+	int i, n;
+
+	if (clock_source != CLOCK_INTERNAL) return;
+
+	interval = time - tap_frame;
+	tap_frame = time;
+	if ((tap_count < 0) || (interval > (sample_rate * 60.0 / MIN_BPM)) || (interval < (sample_rate * 60.0 / MAX_BPM))) {
+		tap_count = 0;
+		return;
+	}
+
+	// intervals are kept in a ring of TAP_COUNT entries
+	tap_intervals [tap_count % TAP_COUNT] = interval;
+	tap_count++;
+	n = (tap_count < TAP_COUNT) ? tap_count : TAP_COUNT;
+	for (i = 0, sum = 0.0; i < n; i++) sum += tap_intervals [i];
+
+	clock_bpm = (sample_rate * 60.0 * n) / sum;
+}
+
+
+// timebase callback (boocli is timebase master): bars, beats and ticks of the transport, at a fixed tempo, in the current time signature
+static void clock_timebase (jack_transport_state_t state, jack_nframes_t nframes, jack_position_t *pos, int new_pos, void *arg) {
+
+	double beats, bar, bpm;
+
+	__atomic_load (&timebase_bpm, &bpm, __ATOMIC_ACQUIRE);
+	pos->valid = JackPositionBBT;
+	pos->beats_per_bar = BBT_numerator;
+	pos->beat_type = BBT_denominator;
+	pos->ticks_per_beat = TIMEBASE_TICKS;
+	pos->beats_per_minute = bpm;
+
+	// beats (1/beat_type notes) since the start of the transport, at this tempo
+	beats = (pos->frame * bpm) / (60.0 * pos->frame_rate);
+	bar = floor (beats / pos->beats_per_bar);
+	beats -= bar * pos->beats_per_bar;
+	pos->bar = (int32_t) bar + 1;
+	pos->beat = (int32_t) floor (beats) + 1;
+	pos->tick = (int32_t) floor ((beats - floor (beats)) * TIMEBASE_TICKS);
+	pos->bar_start_tick = bar * pos->beats_per_bar * TIMEBASE_TICKS;
+}
+
+
+/******************************************/
+/* functions for the main thread          */
+/******************************************/
+
+// stop the internal clock: midi stop is sent at the next cycle, which is waited for (called when boocli quits)
+void clock_stop () {
+
+	if (clock_source != CLOCK_INTERNAL) return;
+
+	__atomic_store_n (&is_stop_request, TRUE, __ATOMIC_RELEASE);
+	usleep ((2 * 1000000.0 * nb_frames_per_packet) / sample_rate);
+}
+
+
+// init the tempo estimators of the clock inputs, and become timebase master of the JACK transport (when clock source is the transport)
+int clock_init () {
+
+	int i;
+
+	for (i = 0; i < CLOCK_INPUTS; i++) {
+		memset (&clock_inputs [i], 0, sizeof (clock_input_t));
+		tempo_init (&clock_inputs [i].tempo, TEMPO_BANDWIDTH);
+		clock_inputs [i].state = INPUT_IDLE;
+	}
+
+	// tempo given in config file, until tap pad changes it
+	clock_bpm = master_bpm;
+	timebase_bpm = master_bpm;
+
+	if ((clock_source != CLOCK_TRANSPORT) || !is_timebase) return 0;
+
+	if (jack_set_timebase_callback (client, 0, clock_timebase, NULL) != 0) {
+		fprintf ( stderr, "Cannot become timebase master of JACK transport.\n" );
+		return 0;
+	}
+
+	return 1;
+}
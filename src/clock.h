@@ -0,0 +1,12 @@
+/** @file clock.h
+ *
+ * @brief This file defines prototypes of functions inside clock.c
+ *
+ */
+
+void clock_start (jack_nframes_t);
+int clock_next (jack_midi_event_t *);
+jack_nframes_t clock_tick_frame ();
+void clock_tap (jack_nframes_t);
+void clock_stop ();
+int clock_init ();
@@ -0,0 +1,145 @@
+/** @file command.c
+ *
+ * @brief Command queue between the realtime thread and the main thread.
+ * Slow operations (load, save...) triggered from the realtime thread are sent as commands to the main thread,
+ * which waits for them on a semaphore. Once done, the main thread sends a reply back to the realtime thread,
+ * which completes the command (leds, etc) at the next audio cycle. Both queues are lock-free rings (single producer, single consumer).
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "led.h"
+#include "time.h"
+#include "utils.h"
+#include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
+
+
+static jack_ringbuffer_t *command_ring;		// commands from realtime thread to main thread
+static jack_ringbuffer_t *reply_ring;		// replies from main thread to realtime thread
+static sem_t command_sem;					// main thread waits on this for new commands
+static int is_pending [LAST_CMD];			// TRUE if a command has been sent and no reply has been received yet (used by realtime thread only)
+
+
+// create command and reply rings
+int command_init () {
+
+	command_ring = jack_ringbuffer_create (COMMAND_ELT * sizeof (command_t));
+	reply_ring = jack_ringbuffer_create (COMMAND_ELT * sizeof (command_t));
+	if ((command_ring == NULL) || (reply_ring == NULL)) {
+		fprintf ( stderr, "error in creating command rings.\n" );
+		exit ( 1 );
+	}
+	jack_ringbuffer_mlock (command_ring);
+	jack_ringbuffer_mlock (reply_ring);
+	sem_init (&command_sem, 0, 0);
+	memset (is_pending, FALSE, sizeof (is_pending));
+
+	return 0;
+}
+
+
+/**************************************/
+/* functions for the realtime thread  */
+/**************************************/
+
+// send a command to the main thread; returns 1 if command has been sent
+// a command which is already pending (ie. no reply yet) is not sent twice; notifications can be sent several times
+int command_send (int type, int arg) {
+
+	command_t cmd;
+
+	if ((type < FIRST_NOTIFY) && is_pending [type]) return 0;
+	if (jack_ringbuffer_write_space (command_ring) < sizeof (command_t)) return 0;
+
+	cmd.type = type;
+	cmd.arg = arg;
+	jack_ringbuffer_write (command_ring, (char *) &cmd, sizeof (command_t));
+	if (type < FIRST_NOTIFY) is_pending [type] = TRUE;
+
+	// wake up main thread
+	sem_post (&command_sem);
+	return 1;
+}
+
+
+// get replies from the main thread, and complete the commands accordingly
+int command_process () {
+
+	command_t cmd;
+
+	while (jack_ringbuffer_read (reply_ring, (char *) &cmd, sizeof (command_t)) == sizeof (command_t)) {
+
+		switch (cmd.type) {
+			case CMD_LOAD:
+				// session has been loaded in the shadow tracks: these will be swapped with the tracks at next bar (load led remains on until then)
+				if (cmd.arg) is_swap = PENDING_ON;
+				// load has failed: load led off
+				else led (0, LOAD, OFF);
+				break;
+			case CMD_SAVE:
+				// save is done: blocks released by the tracks meanwhile go back to the audio pool, and save led off
+				pool_pin (FALSE);
+				led (0, SAVE, OFF);
+				break;
+			case CMD_RECYCLE:
+				// previous audio buffers are back in the audio pool: a new session can be loaded
+				is_swap = OFF;
+				break;
+			case CMD_STRETCH:
+				// track has been stretched: it will be swapped at next bar (stretch led remains on until then); or stretch has failed
+				stretch_reply (cmd.arg);
+				break;
+			case CMD_UNSTRETCH:
+				// previous audio buffers of the stretched track are back in the audio pool: a new stretch can be requested
+				stretch_recycled ();
+				break;
+		}
+
+		is_pending [cmd.type] = FALSE;
+	}
+
+	return 0;
+}
+
+
+/******************************************/
+/* functions for the main thread          */
+/******************************************/
+
+// wait for a command from the realtime thread
+int command_wait (command_t *cmd) {
+
+	while (jack_ringbuffer_read (command_ring, (char *) cmd, sizeof (command_t)) != sizeof (command_t)) {
+		sem_wait (&command_sem);
+	}
+
+	return 0;
+}
+
+
+// send a reply to the realtime thread, once command is done
+int command_reply (int type, int arg) {
+
+	command_t cmd;
+
+	cmd.type = type;
+	cmd.arg = arg;
+	if (jack_ringbuffer_write (reply_ring, (char *) &cmd, sizeof (command_t)) != sizeof (command_t)) {
+		fprintf ( stderr, "too many replies in the command queue.\n" );
+		return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,11 @@
+/** @file command.h
+ *
+ * @brief This file defines prototypes of functions inside command.c
+ *
+ */
+
+int command_init ();
+int command_send (int, int);
+int command_process ();
+int command_wait (command_t *);
+int command_reply (int, int);
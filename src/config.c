@@ -14,6 +14,15 @@
 #include "time.h"
 #include "utils.h"
 #include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
 
 
 /* This example reads the configuration file 'example.cfg' and displays
@@ -43,6 +52,111 @@ int read_config (char *name)
 	/* Read a dummy name; this is mostly to remember how to read a single config parameter */
 	if(!config_lookup_string(&cfg, "name", &str)) fprintf ( stderr, "Unable to read config name.\n" );
 
+	/*****************************************************************************************************/
+	/* Read number of tracks : command line has priority, then config file, then number of track controls */
+	/*****************************************************************************************************/
+
+	if (nb_tracks == 0) {
+		if (config_lookup_int (&cfg, "nb_tracks", &nb_tracks)) {
+			/* check boundaries */
+			if ((nb_tracks < 1) || (nb_tracks > MAX_TRACKS)) {
+				fprintf ( stderr, "number of tracks shall be between 1 and %d.\n", MAX_TRACKS );
+				config_destroy(&cfg);
+				return(EXIT_FAILURE);
+			}
+		}
+		else {
+			/* not specified: take the number of tracks defined in the controls, or default value */
+			setting = config_lookup(&cfg, "controls.tracks");
+			nb_tracks = (setting != NULL) ? config_setting_length(setting) : NB_TRACKS;
+			if (nb_tracks < 1) nb_tracks = NB_TRACKS;
+			if (nb_tracks > MAX_TRACKS) nb_tracks = MAX_TRACKS;
+		}
+	}
+
+	/* size of the audio pool, in MB */
+	if (config_lookup_int (&cfg, "memory", &pool_size)) {
+		if (pool_size < 1) pool_size = POOL_SIZE;
+	}
+
+	/* huge pages for the audio pool */
+	if (config_lookup_string (&cfg, "hugepages", &str)) {
+		if (strcmp (str, "transparent") == 0) hugepages = HUGEPAGES_TRANSPARENT;
+		else if (strcmp (str, "explicit") == 0) hugepages = HUGEPAGES_EXPLICIT;
+		else hugepages = HUGEPAGES_OFF;
+	}
+
+	/* mmap mode: loaded tracks are mapped from session files */
+	config_lookup_bool (&cfg, "mmap", &is_mmap);
+
+	/* playback resampling: loops follow the tempo of the clock */
+	config_lookup_bool (&cfg, "resample", &is_resample);
+
+	/* timing statistics of the process callback, published in a shared memory block (see boocli_stats) */
+	config_lookup_bool (&cfg, "stats", &is_stats);
+
+	/* clock source: midi clock, JACK transport (boocli may then be timebase master, at the tempo given by bpm) or internal clock (at the tempo given by bpm) */
+	if (config_lookup_string (&cfg, "clock", &str)) {
+		if (strcmp (str, "transport") == 0) clock_source = CLOCK_TRANSPORT;
+		else if (strcmp (str, "internal") == 0) clock_source = CLOCK_INTERNAL;
+		else clock_source = CLOCK_MIDI;
+	}
+	/* midi clock inputs, and primary input (1 to clock_inputs) */
+	if (config_lookup_int (&cfg, "clock_inputs", &nb_clock_inputs)) {
+		if ((nb_clock_inputs < 1) || (nb_clock_inputs > CLOCK_INPUTS)) nb_clock_inputs = 1;
+	}
+	if (config_lookup_int (&cfg, "clock_primary", &clock_primary)) {
+		if ((clock_primary < 1) || (clock_primary > nb_clock_inputs)) clock_primary = 1;
+		clock_primary--;
+	}
+	config_lookup_bool (&cfg, "timebase_master", &is_timebase);
+	if (config_lookup_float (&cfg, "bpm", &master_bpm)) {
+		if ((master_bpm < MIN_BPM) || (master_bpm > MAX_BPM)) master_bpm = MASTER_BPM;
+	}
+
+	/* maximum number of led messages per second sent to the control surface (0: no limit) */
+	if (config_lookup_int (&cfg, "led_rate", &led_rate)) {
+		if (led_rate < 0) led_rate = LED_RATE;
+	}
+
+	/* led output: midi messages, or bulk SysEx messages for Launchpad controllers, with the header of the "set leds" SysEx of the controller */
+	if (config_lookup_string (&cfg, "led_output", &str)) {
+		if (strcmp (str, "launchpad") == 0) led_output = LED_LAUNCHPAD;
+		else led_output = LED_MIDI;
+	}
+	setting = config_lookup(&cfg, "led_sysex");
+	if ((setting != NULL) && (config_setting_length(setting) > 0))
+	{
+		if (config_setting_length(setting) > LED_SYSEX) fprintf ( stderr, "led_sysex is too long: default header is used.\n" );
+		else {
+			led_sysex_size = config_setting_length(setting);
+			for (i = 0; i < led_sysex_size; ++i) led_sysex [i] = (unsigned char) (config_setting_get_int_elem (setting, i) & 0x7F);
+		}
+	}
+
+	/* time signatures selected by the time signature pad: list of (numerator, denominator) which replaces the default list */
+	setting = config_lookup(&cfg, "time_signatures");
+	if ((setting != NULL) && (config_setting_length(setting) > 0))
+	{
+		int count = config_setting_length(setting);
+		int added = 0;
+
+		clear_timesigns ();
+		for (i = 0; i < count; ++i)
+		{
+			buffer = config_setting_get_elem (setting, i);
+			/* check buffer has 2 elements */
+			if (config_setting_length(buffer)!=2) continue;
+			if (add_timesign (config_setting_get_int_elem (buffer, 0), config_setting_get_int_elem (buffer, 1)) >= 0) added++;
+			else fprintf ( stderr, "time signature %d/%d is not supported.\n", config_setting_get_int_elem (buffer, 0), config_setting_get_int_elem (buffer, 1) );
+		}
+		/* no valid time signature: 4/4 */
+		if (added == 0) add_timesign (4, 4);
+	}
+
+	/* allocate track structures, now that we know how many tracks we have */
+	init_tracks ();
+
 	/****************************************************************************/
 	/* Read connection settings : connection of server port X to client port Y  */
 	/****************************************************************************/
@@ -170,6 +284,30 @@ int read_config (char *name)
 		}
 	}
 
+	/* midi clock outputs */
+	setting = config_lookup(&cfg, "connections.clock_output");
+	if(setting != NULL)
+	{
+		int count = config_setting_length(setting);
+
+		for(i = 0; i < count; ++i)
+		{
+			config_setting_t *book = config_setting_get_elem(setting, i);
+
+			/* Only output the record if all of the expected fields are present. */
+			const char *port_server, *port_client;
+
+			if(!(config_setting_lookup_string(book, "server", &port_server)
+					 && config_setting_lookup_string(book, "client", &port_client)))
+				continue;
+
+			/* copy the ports found in config file to an array of string, and increment the index in the table */
+			/* for inputs, jack port is the input and shall be first in the array */
+			strcpy (ports_to_connect [index++], port_server);
+			strcpy (ports_to_connect [index++], port_client);
+		}
+	}
+
 
 	/*****************************************************************************************************/
 	/* Read control settings : assign midi events to control each function of the looper, for each track */
@@ -182,7 +320,7 @@ int read_config (char *name)
 		int count = config_setting_length(setting);
 
 		/* Check we don't have a too large number of tracks defined, in which case we set to the maximum */
-		if (count > NB_TRACKS) count = NB_TRACKS;
+		if (count > nb_tracks) count = nb_tracks;
 
 		 /* read element by element */
 		for (i = 0; i < count; ++i)
@@ -277,6 +415,22 @@ int read_config (char *name)
 			if (config_setting_length(buffer)!=2) continue;
 			track[i].ctrl[DELETE][0] = config_setting_get_int_elem (buffer, 0);
 			track[i].ctrl[DELETE][1] = config_setting_get_int_elem (buffer, 1);
+
+			/* stretch */
+			buffer = config_setting_get_member (book, "stretch");
+			/* check buffer is not empty, and has 2 elements */
+			if (!buffer) continue;
+			if (config_setting_length(buffer)!=2) continue;
+			track[i].ctrl[STRETCH][0] = config_setting_get_int_elem (buffer, 0);
+			track[i].ctrl[STRETCH][1] = config_setting_get_int_elem (buffer, 1);
+
+			/* tap tempo */
+			buffer = config_setting_get_member (book, "tap");
+			/* check buffer is not empty, and has 2 elements */
+			if (!buffer) continue;
+			if (config_setting_length(buffer)!=2) continue;
+			track[i].ctrl[TAP][0] = config_setting_get_int_elem (buffer, 0);
+			track[i].ctrl[TAP][1] = config_setting_get_int_elem (buffer, 1);
 		}
 	}
 
@@ -287,7 +441,7 @@ int read_config (char *name)
 		int count = config_setting_length(setting);
 
 		/* Check we don't have a too large number of tracks defined, in which case we set to the maximum */
-		if (count > NB_TRACKS) count = NB_TRACKS;
+		if (count > nb_tracks) count = nb_tracks;
 
 		 /* read element by element */
 		for (i = 0; i < count; ++i)
@@ -393,6 +547,24 @@ int read_config (char *name)
 			track[i].led[DELETE][ON][0] = config_setting_get_int_elem (buffer, 0);
 			track[i].led[DELETE][ON][1] = config_setting_get_int_elem (buffer, 1);
 			track[i].led[DELETE][ON][2] = config_setting_get_int_elem (buffer, 2);
+
+			/* stretch */
+			buffer = config_setting_get_member (book, "stretch");
+			/* check buffer is not empty, and has 3 elements */
+			if (!buffer) continue;
+			if (config_setting_length(buffer)!=3) continue;
+			track[i].led[STRETCH][ON][0] = config_setting_get_int_elem (buffer, 0);
+			track[i].led[STRETCH][ON][1] = config_setting_get_int_elem (buffer, 1);
+			track[i].led[STRETCH][ON][2] = config_setting_get_int_elem (buffer, 2);
+
+			/* tap tempo */
+			buffer = config_setting_get_member (book, "tap");
+			/* check buffer is not empty, and has 3 elements */
+			if (!buffer) continue;
+			if (config_setting_length(buffer)!=3) continue;
+			track[i].led[TAP][ON][0] = config_setting_get_int_elem (buffer, 0);
+			track[i].led[TAP][ON][1] = config_setting_get_int_elem (buffer, 1);
+			track[i].led[TAP][ON][2] = config_setting_get_int_elem (buffer, 2);
 		}
 	}
 
@@ -403,7 +575,7 @@ int read_config (char *name)
 		int count = config_setting_length(setting);
 
 		/* Check we don't have a too large number of tracks defined, in which case we set to the maximum */
-		if (count > NB_TRACKS) count = NB_TRACKS;
+		if (count > nb_tracks) count = nb_tracks;
 
 		 /* read element by element */
 		for (i = 0; i < count; ++i)
@@ -464,6 +636,24 @@ int read_config (char *name)
 			track[i].led[DELETE][PENDING_ON][0] = config_setting_get_int_elem (buffer, 0);
 			track[i].led[DELETE][PENDING_ON][1] = config_setting_get_int_elem (buffer, 1);
 			track[i].led[DELETE][PENDING_ON][2] = config_setting_get_int_elem (buffer, 2);
+
+			/* stretch */
+			buffer = config_setting_get_member (book, "stretch");
+			/* check buffer is not empty, and has 3 elements */
+			if (!buffer) continue;
+			if (config_setting_length(buffer)!=3) continue;
+			track[i].led[STRETCH][PENDING_ON][0] = config_setting_get_int_elem (buffer, 0);
+			track[i].led[STRETCH][PENDING_ON][1] = config_setting_get_int_elem (buffer, 1);
+			track[i].led[STRETCH][PENDING_ON][2] = config_setting_get_int_elem (buffer, 2);
+
+			/* tap tempo */
+			buffer = config_setting_get_member (book, "tap");
+			/* check buffer is not empty, and has 3 elements */
+			if (!buffer) continue;
+			if (config_setting_length(buffer)!=3) continue;
+			track[i].led[TAP][PENDING_ON][0] = config_setting_get_int_elem (buffer, 0);
+			track[i].led[TAP][PENDING_ON][1] = config_setting_get_int_elem (buffer, 1);
+			track[i].led[TAP][PENDING_ON][2] = config_setting_get_int_elem (buffer, 2);
 		}
 	}
 
@@ -474,7 +664,7 @@ int read_config (char *name)
 		int count = config_setting_length(setting);
 
 		/* Check we don't have a too large number of tracks defined, in which case we set to the maximum */
-		if (count > NB_TRACKS) count = NB_TRACKS;
+		if (count > nb_tracks) count = nb_tracks;
 
 		 /* read element by element */
 		for (i = 0; i < count; ++i)
@@ -535,6 +725,24 @@ int read_config (char *name)
 			track[i].led[DELETE][PENDING_OFF][0] = config_setting_get_int_elem (buffer, 0);
 			track[i].led[DELETE][PENDING_OFF][1] = config_setting_get_int_elem (buffer, 1);
 			track[i].led[DELETE][PENDING_OFF][2] = config_setting_get_int_elem (buffer, 2);
+
+			/* stretch */
+			buffer = config_setting_get_member (book, "stretch");
+			/* check buffer is not empty, and has 3 elements */
+			if (!buffer) continue;
+			if (config_setting_length(buffer)!=3) continue;
+			track[i].led[STRETCH][PENDING_OFF][0] = config_setting_get_int_elem (buffer, 0);
+			track[i].led[STRETCH][PENDING_OFF][1] = config_setting_get_int_elem (buffer, 1);
+			track[i].led[STRETCH][PENDING_OFF][2] = config_setting_get_int_elem (buffer, 2);
+
+			/* tap tempo */
+			buffer = config_setting_get_member (book, "tap");
+			/* check buffer is not empty, and has 3 elements */
+			if (!buffer) continue;
+			if (config_setting_length(buffer)!=3) continue;
+			track[i].led[TAP][PENDING_OFF][0] = config_setting_get_int_elem (buffer, 0);
+			track[i].led[TAP][PENDING_OFF][1] = config_setting_get_int_elem (buffer, 1);
+			track[i].led[TAP][PENDING_OFF][2] = config_setting_get_int_elem (buffer, 2);
 		}
 	}
 
@@ -545,7 +753,7 @@ int read_config (char *name)
 		int count = config_setting_length(setting);
 
 		/* Check we don't have a too large number of tracks defined, in which case we set to the maximum */
-		if (count > NB_TRACKS) count = NB_TRACKS;
+		if (count > nb_tracks) count = nb_tracks;
 
 		 /* read element by element */
 		for (i = 0; i < count; ++i)
@@ -651,6 +859,24 @@ int read_config (char *name)
 			track[i].led[DELETE][OFF][0] = config_setting_get_int_elem (buffer, 0);
 			track[i].led[DELETE][OFF][1] = config_setting_get_int_elem (buffer, 1);
 			track[i].led[DELETE][OFF][2] = config_setting_get_int_elem (buffer, 2);
+
+			/* stretch */
+			buffer = config_setting_get_member (book, "stretch");
+			/* check buffer is not empty, and has 3 elements */
+			if (!buffer) continue;
+			if (config_setting_length(buffer)!=3) continue;
+			track[i].led[STRETCH][OFF][0] = config_setting_get_int_elem (buffer, 0);
+			track[i].led[STRETCH][OFF][1] = config_setting_get_int_elem (buffer, 1);
+			track[i].led[STRETCH][OFF][2] = config_setting_get_int_elem (buffer, 2);
+
+			/* tap tempo */
+			buffer = config_setting_get_member (book, "tap");
+			/* check buffer is not empty, and has 3 elements */
+			if (!buffer) continue;
+			if (config_setting_length(buffer)!=3) continue;
+			track[i].led[TAP][OFF][0] = config_setting_get_int_elem (buffer, 0);
+			track[i].led[TAP][OFF][1] = config_setting_get_int_elem (buffer, 1);
+			track[i].led[TAP][OFF][2] = config_setting_get_int_elem (buffer, 2);
 		}
 	}
 
@@ -920,6 +1146,9 @@ int read_config (char *name)
 		}
 	}
 
+	/* dispatch table of the controls: controls used by several functions are reported */
+	if (build_controls () > 0) fprintf ( stderr, "some controls are used by several functions; check config file.\n" );
+
 	/* successful reading, exit */
 	config_destroy(&cfg);
 	return(EXIT_SUCCESS);
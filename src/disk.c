@@ -12,98 +12,594 @@
 #include "time.h"
 #include "utils.h"
 #include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+
+static int shadow_timesign;		// time signature of the session loaded in the shadow tracks
+static int saved_numerator;		// time signature of the saved tracks (see snapshot)
+static int saved_denominator;
+static unsigned int saved_take [MAX_TRACKS];	// take of each saved track, which tells if its take file can be used by the save
+
+// session files mapped in memory (mmap mode), used by main thread only: tracks only know the number of their mapping (track_t map)
+static struct {
+	unsigned char *addr;		// address of the mapping (NULL if not used)
+	size_t size;				// size of the mapping
+} maps [MAX_MAPS];
+
+
+// session files (see SESSION_VERSION); all fields are 32 bits little endian integers, so files do not depend on the compiler nor on track_t
+//
+// session file (SAVE_FILE): metadata of the session
+//	magic (SESSION_MAGIC), version, size of header (in fields), size of a track entry (in fields), number of tracks, numerator, denominator, sample rate
+//	then for each track: end index (left, right), record bar (left, right), end bar (left, right), number of bars recorded,
+//	tempo of the recording in samples per tick (16.16 fixed point, 0 if unknown; since version 2)
+//	then checksum (crc32) of all the previous fields
+//	readers skip the fields they do not know (header or track entries may grow in future versions)
+//
+// track audio file (SAVE_FILE.n): audio of track n, which can be mapped in memory
+//	header of TRACK_HEADER bytes: magic (TRACK_MAGIC), version, size of header (in bytes), size of blocks (in samples), number of blocks, length (left, right),
+//	offset of left samples, offset of right samples (low, high), checksums (crc32) of the blocks (left, then right), and checksum of the header in the last 4 bytes
+//	then left samples (page aligned), then right samples (page aligned); file may be sparse
+
+
+// write a 32 bits little endian field
+static void put_field (unsigned char *p, unsigned int value) {
+
+	p [0] = value & 0xFF;
+	p [1] = (value >> 8) & 0xFF;
+	p [2] = (value >> 16) & 0xFF;
+	p [3] = (value >> 24) & 0xFF;
+}
+
+
+// read a 32 bits little endian field
+static unsigned int get_field (const unsigned char *p) {
+
+	return (unsigned int) p [0] | ((unsigned int) p [1] << 8) | ((unsigned int) p [2] << 16) | ((unsigned int) p [3] << 24);
+}
+
+
+// write the header of a track audio file; "crc_left" and "crc_right" are the checksums of the blocks of each channel
+// this is also used by the recorder, at the end of a take; returns 1 if header has been written
+int write_track_header (int fd, jack_nframes_t length_left, jack_nframes_t length_right, unsigned int *crc_left, unsigned int *crc_right) {
+
+	unsigned char header [TRACK_HEADER];
+	jack_nframes_t b;
+
+	memset (header, 0, TRACK_HEADER);
+	put_field (header, TRACK_MAGIC);
+	put_field (header + 4, SESSION_VERSION);
+	put_field (header + 8, TRACK_HEADER);
+	put_field (header + 12, POOL_BLOCK);
+	put_field (header + 16, NB_BLOCKS);
+	put_field (header + 20, length_left);
+	put_field (header + 24, length_right);
+	put_field (header + 28, (unsigned int) LEFT_OFFSET);
+	put_field (header + 32, (unsigned int) RIGHT_OFFSET);
+	put_field (header + 36, (unsigned int) ((unsigned long long) RIGHT_OFFSET >> 32));
+	for (b = 0; b < NB_BLOCKS; b++) {
+		put_field (header + (TRACK_FIELDS + b) * 4, crc_left [b]);
+		put_field (header + (TRACK_FIELDS + NB_BLOCKS + b) * 4, crc_right [b]);
+	}
+	put_field (header + TRACK_HEADER - 4, crc32 (0, header, TRACK_HEADER - 4));
+
+	return (pwrite (fd, header, TRACK_HEADER, 0) == TRACK_HEADER);
+}
+
+
+// copy "length" samples of a channel from a mapped track audio file into a track buffer, and check the checksums of the blocks
+// blocks are taken from the audio pool when required; blocks after the end of the samples (from a previous recording) go back to the audio pool
+// samples which are not in the file (end of a sparse file) are silence
+static int read_buffer (jack_default_audio_sample_t **buffer, jack_nframes_t length, const unsigned char *map, off_t size, off_t offset, const unsigned char *crc) {
+
+	jack_nframes_t b, n;
+	off_t start;
+	size_t bytes;
+
+	for (b = 0; b < NB_BLOCKS; b++) {
+		n = (length > POOL_BLOCK) ? POOL_BLOCK : length;
+
+		// no more samples to read: release block
+		if (n == 0) {
+			if (buffer [b] != NULL) pool_free (buffer [b]);
+			buffer [b] = NULL;
+			continue;
+		}
+
+		// new block required
+		if ((buffer [b] == NULL) && ((buffer [b] = pool_alloc ()) == NULL)) {
+			fprintf ( stderr, "audio pool exhausted, cannot read save file.\n" );
+			return 0;
+		}
+
+		// copy samples available in the file
+		start = offset + ((off_t) b << POOL_BLOCK_SHIFT) * sizeof (jack_default_audio_sample_t);
+		bytes = (start >= size) ? 0 : (size_t) (size - start);
+		if (bytes > n * sizeof (jack_default_audio_sample_t)) bytes = n * sizeof (jack_default_audio_sample_t);
+		memcpy (buffer [b], map + start, bytes);
+		memset ((char *) buffer [b] + bytes, 0, n * sizeof (jack_default_audio_sample_t) - bytes);
+
+		// check the block
+		if (crc32 (0, buffer [b], n * sizeof (jack_default_audio_sample_t)) != get_field (crc + b * 4)) {
+			fprintf ( stderr, "checksum error in block %u.\n", b );
+			return 0;
+		}
+		length -= n;
+	}
+
+	return 1;
+}
+
+
+// write "length" samples of a track buffer to file at the current position, and compute the checksums of the blocks
+// blocks which are not used are written as silence
+static int write_buffer (jack_default_audio_sample_t **buffer, jack_nframes_t length, FILE *fp, unsigned int *crc) {
+
+	static jack_default_audio_sample_t silence [POOL_BLOCK];
+	jack_default_audio_sample_t *data;
+	jack_nframes_t b, n;
+
+	for (b = 0; (b < NB_BLOCKS) && (length > 0); b++) {
+		n = (length > POOL_BLOCK) ? POOL_BLOCK : length;
+		data = (buffer [b] != NULL) ? buffer [b] : silence;
+		if (fwrite (data, sizeof (jack_default_audio_sample_t), n, fp) != n) return 0;
+		crc [b] = crc32 (0, data, n * sizeof (jack_default_audio_sample_t));
+		length -= n;
+	}
+
+	return 1;
+}
+
+
+// mmap mode: point the blocks of a track buffer to "length" samples of a mapped track audio file, at "offset"
+// pages are read and locked now, so the realtime thread never waits for the disk
+static int lock_buffer (jack_default_audio_sample_t **buffer, jack_nframes_t length, unsigned char *map, off_t offset) {
+
+	long page = sysconf (_SC_PAGESIZE);
+	size_t bytes = ((length * sizeof (jack_default_audio_sample_t)) + page - 1) & ~(page - 1);
+	jack_nframes_t b;
+
+	if ((offset % page) != 0) return 0;
+	madvise (map + offset, bytes, MADV_WILLNEED);
+	if (mlock (map + offset, bytes) != 0) return 0;
+
+	for (b = 0; b < NB_BLOCKS; b++) {
+		if (buffer [b] != NULL) pool_free (buffer [b]);
+		buffer [b] = ((b << POOL_BLOCK_SHIFT) < length) ? (jack_default_audio_sample_t *) (map + offset + ((off_t) b << POOL_BLOCK_SHIFT) * sizeof (jack_default_audio_sample_t)) : NULL;
+	}
+
+	return 1;
+}
+
+
+// mmap mode: track buffers point into the mapped track audio file (which is kept mapped); returns 0 if track shall be copied to the audio pool instead
+// checksums of the blocks are not checked, as this would read the whole file
+static int map_track (track_t *t, int tracknum, unsigned char *map, off_t size, off_t left, off_t right) {
+
+	int m;
+
+	for (m = 0; (m < MAX_MAPS) && (maps [m].addr != NULL); m++);
+	if (m == MAX_MAPS) return 0;
+
+	if ((left + (off_t) t->end_index_left * sizeof (jack_default_audio_sample_t) > size) || (right + (off_t) t->end_index_right * sizeof (jack_default_audio_sample_t) > size) ||
+		!lock_buffer (t->left, t->end_index_left, map, left) || !lock_buffer (t->right, t->end_index_right, map, right)) {
+		fprintf ( stderr, "cannot map track %d (%s), loading it in the audio pool.\n", tracknum + 1, strerror (errno) );
+		munlock (map, size);
+		memset (t->left, 0, NB_BLOCKS * sizeof (jack_default_audio_sample_t *));
+		memset (t->right, 0, NB_BLOCKS * sizeof (jack_default_audio_sample_t *));
+		return 0;
+	}
+
+	maps [m].addr = map;
+	maps [m].size = size;
+	t->map = m + 1;
+	return 1;
+}
+
+
+// read the audio of a track from its track audio file, which is mapped in memory (no intermediate copy)
+// in mmap mode, the track audio file remains mapped, and track buffers point into it
+static int read_track (track_t *t, int tracknum) {
+
+	int fd;
+	char name [64];
+	struct stat st;
+	unsigned char *map;
+	unsigned int nb_blocks;
+	off_t left, right;
+	int ret = 0;
+
+	sprintf (name, "%s.%d", SAVE_FILE, tracknum + 1);
+	fd = open (name, O_RDONLY);
+	if (fd < 0) return 0;
+	if ((fstat (fd, &st) != 0) || (st.st_size < TRACK_HEADER)) {
+		close (fd);
+		return 0;
+	}
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) return 0;
+	madvise (map, st.st_size, MADV_SEQUENTIAL);
+
+	// check header: header of newer versions shall only be read if they are compatible
+	nb_blocks = get_field (map + 16);
+	left = get_field (map + 28);
+	right = get_field (map + 32) | ((off_t) get_field (map + 36) << 32);
+	if ((get_field (map) != TRACK_MAGIC) || (get_field (map + 8) != TRACK_HEADER) || (get_field (map + TRACK_HEADER - 4) != crc32 (0, map, TRACK_HEADER - 4)))
+		fprintf ( stderr, "%s is not a valid track file.\n", name );
+	else if ((get_field (map + 12) != POOL_BLOCK) || (nb_blocks > NB_BLOCKS) || ((TRACK_FIELDS + 2 * nb_blocks + 1) * 4 > TRACK_HEADER))
+		fprintf ( stderr, "%s has unsupported block size.\n", name );
+	else if ((get_field (map + 20) != t->end_index_left) || (get_field (map + 24) != t->end_index_right))
+		fprintf ( stderr, "%s does not match session file.\n", name );
+	else if (is_mmap && map_track (t, tracknum, map, st.st_size, left, right)) return 1;
+	else {
+		ret = read_buffer (t->left, t->end_index_left, map, st.st_size, left, map + TRACK_FIELDS * 4)
+			&& read_buffer (t->right, t->end_index_right, map, st.st_size, right, map + (TRACK_FIELDS + nb_blocks) * 4);
+	}
+
+	munmap (map, st.st_size);
+	return ret;
+}
+
+
+// write the audio of a track to its track audio file
+// if the take of the track has been fully streamed to its take file by the recorder, take file just becomes the track audio file; otherwise audio is written from memory
+static int write_track (track_t *t, int tracknum, unsigned int take) {
+
+	static unsigned int crc [2] [NB_BLOCKS];
+	FILE *fp;
+	char name [64];
+	char tmp [64];
+	int ret;
+
+	sprintf (name, "%s.%d", SAVE_FILE, tracknum + 1);
+	if (recorder_save (tracknum, take, name)) return 1;
+
+	// audio is written in a temporary file, which then replaces the track audio file (which may still be mapped by a track)
+	sprintf (tmp, "%s.%d.tmp", SAVE_FILE, tracknum + 1);
+	fp = fopen (tmp, "w");
+	if (fp == NULL) return 0;
+	ret = (fseeko (fp, LEFT_OFFSET, SEEK_SET) == 0) && write_buffer (t->left, t->end_index_left, fp, crc [0])
+		&& (fseeko (fp, RIGHT_OFFSET, SEEK_SET) == 0) && write_buffer (t->right, t->end_index_right, fp, crc [1])
+		&& (fflush (fp) == 0) && write_track_header (fileno (fp), t->end_index_left, t->end_index_right, crc [0], crc [1]);
+	ret = (fdatasync (fileno (fp)) == 0) && ret;
+	fclose (fp);
+	ret = ret && (rename (tmp, name) == 0);
+	if (ret) recorder_saved (tracknum, take);
+
+	return ret;
+}
 
 
 // function called in case user pressed the load pad
+// session is loaded in the shadow tracks, in the background: these will be swapped with the tracks at the next bar (see swap)
+// returns 1 if session has been loaded
 int load () {
 
 	FILE *fp;
+	long size;
+	unsigned char *header, *entry;
+	unsigned int header_fields, entry_fields, number_of_tracks, sample_rate_file;
 	int i;
-	int number_of_tracks;
-	track_t tr;
-	jack_default_audio_sample_t *l, *r;
 
-	// create file in write mode
-	fp = fopen ("./boocli.sav", "r");
+	// read the whole session file
+	fp = fopen (SAVE_FILE, "r");
 	if (fp==NULL) {
 		fprintf ( stderr, "Cannot read save file.\n" );
 		return 0;
 	}
+	fseek (fp, 0, SEEK_END);
+	size = ftell (fp);
+	rewind (fp);
+	header = (size >= (SESSION_HEADER + 1) * 4) ? malloc (size) : NULL;
+	if ((header == NULL) || (fread (header, 1, size, fp) != (size_t) size)) {
+		fprintf ( stderr, "Cannot read save file.\n" );
+		free (header);
+		fclose (fp);
+		return 0;
+	}
+	fclose (fp);
+
+	// check the header
+	// newer versions are read as well, as long as they keep the fields of this version (extra fields are skipped)
+	header_fields = get_field (header + 8);
+	entry_fields = get_field (header + 12);
+	number_of_tracks = get_field (header + 16);
+	if ((get_field (header) != SESSION_MAGIC) || (header_fields < SESSION_HEADER) || (entry_fields < TRACK_ENTRY_MIN) ||
+		((unsigned long long) header_fields + (unsigned long long) number_of_tracks * entry_fields + 1) * 4 != (unsigned long long) size ||
+		(get_field (header + size - 4) != crc32 (0, header, size - 4))) {
+		fprintf ( stderr, "%s is not a valid save file.\n", SAVE_FILE );
+		free (header);
+		return 0;
+	}
+	if (get_field (header + 4) > SESSION_VERSION) fprintf ( stderr, "save file is from a newer version (%u): reading what is known.\n", get_field (header + 4) );
 
-	// read number of tracks
-	fread ((int *) &number_of_tracks, sizeof (int), 1, fp);
-	// if greater than current number of tracks, set to current number of tracks
-	if (number_of_tracks > NB_TRACKS) number_of_tracks = NB_TRACKS;
+	// time signature: added to the list of time signatures if required; if not supported, set to first timesign
+	shadow_timesign = find_timesign (get_field (header + 20), get_field (header + 24));
 
-	// read time signature
-	fread ((int*) &timesign, sizeof (int), 1, fp);
-	// if timesign is out of boundaries, set to first timesign (_4_4)
-	if (timesign > LAST_TIMESIGN) timesign = FIRST_TIMESIGN;
+	// audio is not resampled
+	sample_rate_file = get_field (header + 28);
+	if (sample_rate_file != sample_rate) fprintf ( stderr, "save file has been recorded at %u Hz, and is played at %u Hz.\n", sample_rate_file, sample_rate );
 
 	// read track one by one
-	for (i=0; i<NB_TRACKS;i++) {
+	// number of tracks may differ from current number of tracks: extra tracks of the file are skipped, extra tracks in memory are kept
+	for (i=0; (i<number_of_tracks) && (i<nb_tracks);i++) {
+
+		entry = header + (header_fields + i * entry_fields) * 4;
 
-		// read the whole track struct from file
-		fread (&tr, sizeof (track_t), 1, fp);
 		// check whether there is some audio recorded; if not, read next track
 		// this way: in case the track in the file is empty (non-recorded), the track already in memory is kept and is not overwritten by an empty track
-		if ((tr.end_index_left == 0) && (tr.end_index_right == 0)) continue;
+		if ((get_field (entry) == 0) && (get_field (entry + 4) == 0)) continue;
+
+		// copy the loop information to shadow track (controls and leds remain the ones of the config file)
+		shadow[i].end_index_left = get_field (entry);
+		shadow[i].end_index_right = get_field (entry + 4);
+		shadow[i].record_bar_left = get_field (entry + 8);
+		shadow[i].record_bar_right = get_field (entry + 12);
+		shadow[i].end_bar_left = get_field (entry + 16);
+		shadow[i].end_bar_right = get_field (entry + 20);
+		shadow[i].record_nb_bar = get_field (entry + 24);
+		shadow[i].record_spt = (entry_fields > 7) ? (get_field (entry + 28) / 65536.0) : 0.0;
+
+		// read the audio buffers from the track audio file and write to shadow track
+		if ((shadow[i].end_index_left > NB_SAMPLES + nb_frames_per_packet) || (shadow[i].end_index_right > NB_SAMPLES + nb_frames_per_packet) || !read_track (&shadow[i], i)) {
+			fprintf ( stderr, "Cannot read audio of track %d in save file.\n", i + 1 );
+			free (header);
+			recycle ();
+			return 0;
+		}
+	}
+
+	free (header);
+	return 1;
+}
+
 
-		// save address of audio buffers (absolutely required otherwise we will point anywhere in memory!)
-		l = track[i].left;
-		r = track[i].right;
+// function called by the realtime thread, at the first bar after a session has been loaded in the shadow tracks
+// audio buffers of shadow tracks and of tracks are swapped (this is just a swap of pointers), so the tracks play the loaded session from now on
+// the previous audio buffers (now in shadow tracks) are then given back to the audio pool by the main thread (see recycle)
+int swap () {
 
-		// copy tr variable to track variable
-		memcpy (&track[i], &tr, sizeof(track_t));
+	int i, map;
+	jack_default_audio_sample_t **buffer;
 
-		// restore address of audio buffers
-		track[i].left = l;
-		track[i].right = r;
+	for (i = 0; i < nb_tracks; i++) {
 
-		// read the audio buffers and write to memory
-		if (track[i].end_index_left !=0) fread (track[i].left, sizeof (jack_default_audio_sample_t), track[i].end_index_left, fp);
-		if (track[i].end_index_right !=0) fread (track[i].right, sizeof (jack_default_audio_sample_t), track[i].end_index_right, fp);
+		// reset status of all the tracks, to have a fresh start
+		reset_status (&track[i]);
+		track[i].volume = 1.0f;
+		led_off (i);
+		led (i, VOLUP, ON);
+
+		// empty shadow track: the track already in memory is kept
+		if ((shadow[i].end_index_left == 0) && (shadow[i].end_index_right == 0)) continue;
+
+		// swap audio buffers
+		buffer = track[i].left;
+		track[i].left = shadow[i].left;
+		shadow[i].left = buffer;
+		buffer = track[i].right;
+		track[i].right = shadow[i].right;
+		shadow[i].right = buffer;
+		map = track[i].map;
+		track[i].map = shadow[i].map;
+		shadow[i].map = map;
+
+		// copy the loop information, and reset indexes
+		track[i].end_index_left = shadow[i].end_index_left;
+		track[i].end_index_right = shadow[i].end_index_right;
+		track[i].record_bar_left = shadow[i].record_bar_left;
+		track[i].record_bar_right = shadow[i].record_bar_right;
+		track[i].end_bar_left = shadow[i].end_bar_left;
+		track[i].end_bar_right = shadow[i].end_bar_right;
+		track[i].record_nb_bar = shadow[i].record_nb_bar;
+		track[i].record_spt = shadow[i].record_spt;
+		track[i].play_ratio = 0.0;
+		track[i].play_index_left = 0;
+		track[i].play_index_right = 0;
+		track[i].play_frac_left = 0.0;
+		track[i].play_frac_right = 0.0;
+		track[i].record_index_left = 0;
+		track[i].record_index_right = 0;
+		track[i].last_sample_left = 0.0;
+		track[i].last_sample_right = 0.0;
+		track[i].generation++;
+
+		// audio of the track is now in its session file
+		recorder_loaded (i);
 	}
 
-	// close file
-	fclose (fp);
+	// time signature of the session
+	set_timesign (shadow_timesign);
+
+	// load led off
+	led (0, LOAD, OFF);
+
+	// ask main thread to give previous audio buffers back to the audio pool
+	is_swap = PENDING_OFF;
+	command_send (CMD_RECYCLE, 0);
+	return 0;
+}
+
+
+// function called by main thread, to give all the audio buffers of the shadow tracks back to the audio pool
+// shadow tracks are then empty, and ready for the next load
+int recycle () {
+
+	int i;
+	jack_nframes_t b;
+
+	for (i = 0; i < nb_tracks; i++) {
+		// mapped session file: blocks are not in the audio pool
+		if (shadow[i].map) {
+			memset (shadow[i].left, 0, NB_BLOCKS * sizeof (jack_default_audio_sample_t *));
+			memset (shadow[i].right, 0, NB_BLOCKS * sizeof (jack_default_audio_sample_t *));
+			unmap (shadow[i].map);
+			shadow[i].map = 0;
+		}
+		for (b = 0; b < NB_BLOCKS; b++) {
+			if (shadow[i].left [b] != NULL) pool_free (shadow[i].left [b]);
+			if (shadow[i].right [b] != NULL) pool_free (shadow[i].right [b]);
+			shadow[i].left [b] = NULL;
+			shadow[i].right [b] = NULL;
+		}
+		shadow[i].end_index_left = 0;
+		shadow[i].end_index_right = 0;
+	}
+
+	return 1;
+}
+
+
+// function called by the realtime thread before a track is recorded again or deleted
+// in mmap mode, the blocks of the track may point into its mapped track audio file, which is read-only: these are removed from the track,
+// which then takes new blocks from the audio pool, and main thread is asked to unmap the file
+int detach (int tracknum) {
+
+	if (track[tracknum].map == 0) return 0;
+
+	memset (track[tracknum].left, 0, NB_BLOCKS * sizeof (jack_default_audio_sample_t *));
+	memset (track[tracknum].right, 0, NB_BLOCKS * sizeof (jack_default_audio_sample_t *));
+	command_send (CMD_UNMAP, track[tracknum].map);
+	track[tracknum].map = 0;
+	return 1;
+}
+
+
+// function called by main thread, to unmap a track audio file which is no longer used (mmap mode)
+int unmap (int map) {
+
+	if ((map < 1) || (map > MAX_MAPS) || (maps [map - 1].addr == NULL)) return 0;
+
+	munmap (maps [map - 1].addr, maps [map - 1].size);
+	maps [map - 1].addr = NULL;
+	return 1;
+}
+
+
+// function called by the realtime thread when the save pad is pressed, before main thread saves the session
+// the loop information and the block tables of the tracks are copied to the saved tracks, and the blocks are pinned until the save is done:
+// blocks released meanwhile by the tracks (new recording, delete) are neither cleared nor reused, so main thread always writes the audio of the snapshot
+// a track which is being recorded is saved as an empty track, as its audio is not complete yet
+int snapshot () {
+
+	int i;
+	jack_nframes_t nb_left, nb_right;
+
+	for (i = 0; i < nb_tracks; i++) {
+		saved[i].end_index_left = 0;
+		saved[i].end_index_right = 0;
+		if ((track[i].status[RECORD] == ON) || (track[i].status[RECORD] == PENDING_OFF)) continue;
+
+		// only the blocks of the recording are copied (the save does not read the other ones)
+		nb_left = (track[i].end_index_left + POOL_BLOCK_MASK) >> POOL_BLOCK_SHIFT;
+		nb_right = (track[i].end_index_right + POOL_BLOCK_MASK) >> POOL_BLOCK_SHIFT;
+		if (nb_left > NB_BLOCKS) nb_left = NB_BLOCKS;
+		if (nb_right > NB_BLOCKS) nb_right = NB_BLOCKS;
+		memcpy (saved[i].left, track[i].left, nb_left * sizeof (jack_default_audio_sample_t *));
+		memcpy (saved[i].right, track[i].right, nb_right * sizeof (jack_default_audio_sample_t *));
+
+		saved[i].end_index_left = track[i].end_index_left;
+		saved[i].end_index_right = track[i].end_index_right;
+		saved[i].record_bar_left = track[i].record_bar_left;
+		saved[i].record_bar_right = track[i].record_bar_right;
+		saved[i].end_bar_left = track[i].end_bar_left;
+		saved[i].end_bar_right = track[i].end_bar_right;
+		saved[i].record_nb_bar = track[i].record_nb_bar;
+		saved[i].record_spt = track[i].record_spt;
+		saved_take [i] = recorder_take (i);
+	}
+	saved_numerator = BBT_numerator;
+	saved_denominator = BBT_denominator;
+
+	// blocks go back to the pool when main thread replies to the save command
+	pool_pin (TRUE);
+	return 0;
 }
 
 
 // function called in case user pressed the save pad
+// the saved tracks (snapshot of the tracks when the pad was pressed, see snapshot) are written: realtime thread keeps their blocks until the save is done
+// audio of each track is in its own session file: as tracks are streamed to take files while recording (see recorder), this is usually just a rename
+// metadata file is written last, in a temporary file which is then renamed: a crash during save never leaves a broken session
 int save () {
 
 	FILE *fp;
 	int i;
+	int ret = 1;
+	size_t size;
+	unsigned char *header, *entry;
 
-	// create file in write mode
-	fp = fopen ("./boocli.sav", "w");
-	if (fp==NULL) {
+	// wait until all the audio recorded so far is in the take files
+	recorder_flush ();
+
+	// write audio of each track
+	for (i=0; i<nb_tracks;i++) {
+		if ((saved[i].end_index_left == 0) && (saved[i].end_index_right == 0)) continue;
+		if (!write_track (&saved[i], i, saved_take [i])) {
+			fprintf ( stderr, "Cannot write audio of track %d in save file.\n", i + 1 );
+			ret = 0;
+		}
+	}
+
+	// build session file
+	size = (SESSION_HEADER + nb_tracks * TRACK_ENTRY + 1) * 4;
+	header = calloc (size, 1);
+	if (header == NULL) {
 		fprintf ( stderr, "Cannot write save file.\n" );
 		return 0;
 	}
-
-	// write number of tracks
-	i = NB_TRACKS;
-	fwrite ((int*) &i, sizeof (int), 1, fp);
-
-	// write time signature
-	fwrite ((int*) &timesign, sizeof (int), 1, fp);
+	put_field (header, SESSION_MAGIC);
+	put_field (header + 4, SESSION_VERSION);
+	put_field (header + 8, SESSION_HEADER);
+	put_field (header + 12, TRACK_ENTRY);
+	put_field (header + 16, nb_tracks);
+	put_field (header + 20, saved_numerator);
+	put_field (header + 24, saved_denominator);
+	put_field (header + 28, sample_rate);
 
 	// for each track, write key information
-	// so basically start/stop pointers and samples
-	for (i=0; i<NB_TRACKS;i++) {
-
-		// write the whole track struct in file
-		fwrite (&track[i], sizeof (track_t), 1, fp);
+	// so basically start/stop pointers
+	for (i=0; i<nb_tracks;i++) {
+		entry = header + (SESSION_HEADER + i * TRACK_ENTRY) * 4;
+		put_field (entry, saved[i].end_index_left);
+		put_field (entry + 4, saved[i].end_index_right);
+		put_field (entry + 8, saved[i].record_bar_left);
+		put_field (entry + 12, saved[i].record_bar_right);
+		put_field (entry + 16, saved[i].end_bar_left);
+		put_field (entry + 20, saved[i].end_bar_right);
+		put_field (entry + 24, saved[i].record_nb_bar);
+		put_field (entry + 28, (unsigned int) floor ((saved[i].record_spt * 65536.0) + 0.5));
+	}
+	put_field (header + size - 4, crc32 (0, header, size - 4));
 
-		// write the audio buffers
-		if (track[i].end_index_left !=0) fwrite (track[i].left, sizeof (jack_default_audio_sample_t), track[i].end_index_left, fp);
-		if (track[i].end_index_right !=0) fwrite (track[i].right, sizeof (jack_default_audio_sample_t), track[i].end_index_right, fp);
+	// write session file in a temporary file
+	fp = fopen (SAVE_FILE ".tmp", "w");
+	if (fp==NULL) {
+		fprintf ( stderr, "Cannot write save file.\n" );
+		free (header);
+		return 0;
 	}
+	if (fwrite (header, 1, size, fp) != size) ret = 0;
+	free (header);
 
-	// close file
+	// close file, and replace previous metadata file
+	if ((fflush (fp) != 0) || (fdatasync (fileno (fp)) != 0) || ferror (fp)) ret = 0;
 	fclose (fp);
-}
-
+	if (!ret || (rename (SAVE_FILE ".tmp", SAVE_FILE) != 0)) {
+		fprintf ( stderr, "Cannot write save file.\n" );
+		return 0;
+	}
 
+	return 1;
+}
@@ -5,4 +5,10 @@
  */
 
 int load ();
+int snapshot ();
 int save ();
+int swap ();
+int recycle ();
+int detach (int);
+int unmap (int);
+int write_track_header (int, jack_nframes_t, jack_nframes_t, unsigned int *, unsigned int *);
@@ -10,7 +10,8 @@ extern jack_port_t **input_ports;
 extern jack_port_t **output_ports;
 extern jack_port_t *midi_input_port;
 extern jack_port_t *midi_output_port;
-extern jack_port_t *clock_input_port;
+extern jack_port_t *clock_input_ports [CLOCK_INPUTS];
+extern jack_port_t *clock_output_port;
 extern char **ports_to_connect;
 
 /* define JACKD client : this is this program */
@@ -20,9 +21,17 @@ extern jack_client_t *client;
 extern uint32_t nb_frames_per_packet, sample_rate;
 
 /* define the structures for managing leds of midi control surface */
-extern unsigned char list_buffer[LIST_ELT][4];	// list buffer of LIST_ELT led request
-extern unsigned char list_index;			// index where to write led request to
-extern unsigned char led_status [NB_TRACKS][LAST_ELT]; 	// this table will contain whether each light is on/off at a time; this is to avoid sending led requests which are not required
+extern unsigned short *list_buffer;	// ring of led requests: a request is the number of a led, and each led is at most once in the ring, so that it never overflows
+extern int list_size;					// number of leds, ie. number of led requests the ring can contain
+extern int list_read;					// index where to read next led request from
+extern int list_count;					// number of led requests in the ring
+extern unsigned char *list_queued;		// for each led, whether there is a request for it in the ring
+extern unsigned char *list_sent;		// for each led, last state sent to the control surface
+extern int led_rate;					// maximum number of led messages per second sent to the control surface (0: no limit)
+extern int led_output;					// led output: midi messages, or bulk SysEx messages
+extern unsigned char led_sysex [LED_SYSEX];	// header of the bulk SysEx message, after 0xF0 (default: Launchpad MK2 "set leds")
+extern int led_sysex_size;				// size of the header of the bulk SysEx message
+extern unsigned char (*led_status)[LAST_ELT]; 	// this table will contain whether each light is on/off at a time; this is to avoid sending led requests which are not required
 
 extern unsigned char bar_led_status [NB_BAR_ROWS][LAST_BAR_ELT]; 	// this table will contain whether each light is on/off at a time for a bar row; this is to avoid sending led requests which are not required
 extern int number_of_bars;
@@ -41,15 +50,41 @@ extern int is_BBT; 	// OFF: no new bar, ON: new bar, PENDING_ON: (play event, ch
 extern int timesign;					// the value of this variable indicates which is the current time signature
 
 
+/* number of tracks of the looper */
+extern int nb_tracks;
 /* define track structure for each track of the looper */
-extern track_t track [];
+extern track_t *track;
+/* shadow tracks: a session is loaded in these in the background, then swapped with the tracks at the next bar */
+extern track_t *shadow;
+extern int is_swap;		// OFF: no swap, PENDING_ON: shadow tracks are loaded and will be swapped at next bar, PENDING_OFF: swap done, previous audio buffers are being released
+/* saved tracks: snapshot of the tracks taken when the save pad is pressed, which main thread writes to the session files */
+extern track_t *saved;
+extern int is_paused;	// TRUE after midi stop: tracks neither play nor record, and clock ticks are ignored, until midi continue (or play)
+extern int is_seek;		// ON: song position has changed (midi play, song position pointer): playing tracks are moved to the new position at next clock event
 /* define bar row structure */
 extern bar_t bar [];
 
-/* load & save globals */
-extern int is_load;
-extern int is_save;
+/* tempo estimator of the midi clock */
+extern tempo_t tempo;
+/* playback resampling: loops follow the tempo of the clock */
+extern int is_resample;
+/* clock source (midi clock, JACK transport or internal clock), and tempo when boocli is the clock master (internal clock, or timebase master of JACK transport) */
+extern int clock_source;
+/* number of midi clock input ports, and primary input (the active clock, whenever it is good) */
+extern int nb_clock_inputs;
+extern int clock_primary;
+extern int is_timebase;
+extern double master_bpm;
+
+/* size of the audio pool, in MB, and huge pages used for the audio pool */
+extern int pool_size;
+extern int hugepages;
+/* mmap mode: loaded tracks are read from their session files mapped in memory, instead of being copied to the audio pool */
+extern int is_mmap;
+
+/* timing statistics of the process callback, published in a shared memory block */
+extern int is_stats;
 
 /* PPBAR can vary from 96 to 99, depending on the attached midi clock device */
-extern float ppbar;
+extern int ppbar;			// number of clock ticks per whole note
 
@@ -12,6 +12,15 @@
 #include "time.h"
 #include "utils.h"
 #include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
 
 // function called to turn pad led on/off
 int led (int tracknum, int type, int on_off) {
@@ -39,6 +48,7 @@ int led_off (int tracknum) {
 	led (tracknum, VOLDOWN, OFF);
 	led (tracknum, MODE, OFF);
 	led (tracknum, DELETE, OFF);
+	led (tracknum, STRETCH, OFF);
 }
 
 
@@ -64,3 +74,114 @@ int i;
 
 	for (i=0; i<LAST_BAR_ELT; i++) bar_led (barrownum, i, OFF);
 }
+
+
+// frame of the current cycle from which next led message may be sent (messages are sent at led_rate per second at most)
+static double led_next = 0.0;
+
+
+// get midi message required to light a led; returns 0 if no message is set for this led and state
+static int led_message (int dest, int tracknum, int type, int on_off, unsigned char *buffer) {
+
+	if (dest == TRACK) memcpy (buffer, &track[tracknum].led [type][on_off][0], 3);
+	else memcpy (buffer, &bar[tracknum].led [type][on_off][0], 3);
+
+	return (buffer [0] | buffer [1] | buffer [2]) != 0;
+}
+
+
+// send led requests as midi messages, spread over the cycle
+static void led_send_midi (void *midiout, jack_nframes_t nframes, double interval) {
+
+	unsigned char buffer [3];
+	int dest, tracknum, type, on_off;
+
+	while ((led_next < nframes) && pull_from_list (&dest, &tracknum, &type, &on_off)) {
+		if (!led_message (dest, tracknum, type, on_off, buffer)) continue;
+
+		// midi buffer is full: led will be sent in next cycle
+		if (jack_midi_event_write (midiout, (jack_nframes_t) led_next, buffer, 3)) {
+			retry_list (dest, tracknum, type);
+			break;
+		}
+		led_next += interval;
+	}
+}
+
+
+// send led requests of the cycle in a single SysEx message: note on and control change messages of the leds give (led, colour) pairs
+// appended to the "set leds" header of the controller; other messages are sent as they are
+static void led_send_sysex (void *midiout, jack_nframes_t nframes, double interval) {
+
+	unsigned char buffer [3];
+	unsigned char pairs [LED_PAIRS][2];		// (led, colour) pairs of the SysEx message
+	short pulled [LED_PAIRS][3];			// leds of the pairs, which are sent again if SysEx message cannot be written
+	short slot [128];						// index of each led of the controller in pairs, -1 if not in pairs yet
+	int count = 0, leds = 0, others = 0, dest, tracknum, type, on_off;
+	unsigned char *sysex;
+	size_t size;
+
+	if (led_next >= nframes) return;
+
+	memset (slot, 0xFF, sizeof (slot));
+	while ((leds < LED_PAIRS) && pull_from_list (&dest, &tracknum, &type, &on_off)) {
+		if (!led_message (dest, tracknum, type, on_off, buffer)) continue;
+
+		if ((buffer [0] == 0x90) || (buffer [0] == 0xB0)) {
+			// several functions of boocli may share a led of the controller: last one wins
+			if (slot [buffer [1] & 0x7F] < 0) {
+				slot [buffer [1] & 0x7F] = count;
+				pairs [count][0] = buffer [1] & 0x7F;
+				count++;
+			}
+			pairs [slot [buffer [1] & 0x7F]][1] = buffer [2] & 0x7F;
+			pulled [leds][0] = dest;
+			pulled [leds][1] = tracknum;
+			pulled [leds][2] = type;
+			leds++;
+		}
+		else {
+			// midi buffer is full: led will be sent in next cycle
+			if (jack_midi_event_write (midiout, (jack_nframes_t) led_next, buffer, 3)) {
+				retry_list (dest, tracknum, type);
+				break;
+			}
+			others++;
+		}
+	}
+	led_next += interval * others;
+	if ((count == 0) || (led_next >= nframes)) {
+		while (leds-- > 0) retry_list (pulled [leds][0], pulled [leds][1], pulled [leds][2]);
+		return;
+	}
+
+	// 0xF0, header, pairs, 0xF7
+	size = 1 + led_sysex_size + 2 * count + 1;
+	sysex = jack_midi_event_reserve (midiout, (jack_nframes_t) led_next, size);
+	if (sysex == NULL) {
+		// midi buffer is full: leds will be sent in next cycle
+		while (leds-- > 0) retry_list (pulled [leds][0], pulled [leds][1], pulled [leds][2]);
+		return;
+	}
+	sysex [0] = 0xF0;
+	memcpy (sysex + 1, led_sysex, led_sysex_size);
+	memcpy (sysex + 1 + led_sysex_size, pairs, 2 * count);
+	sysex [size - 1] = 0xF7;
+
+	// bandwidth used is the one of size / 3 midi messages
+	led_next += interval * size / 3;
+}
+
+
+// send the led requests to the control surface, at led_rate midi messages per second at most; requests which cannot be sent in this cycle
+// stay in the ring of requests, where they get the last state of their led
+void led_send (void *midiout, jack_nframes_t nframes) {
+
+	double interval = (led_rate > 0) ? (double) sample_rate / led_rate : 0.0;
+
+	if (led_output == LED_LAUNCHPAD) led_send_sysex (midiout, nframes, interval);
+	else led_send_midi (midiout, nframes, interval);
+
+	// next cycle starts nframes later; if all requests have been sent, next message can be sent at once
+	led_next = (led_next > nframes) ? led_next - nframes : 0.0;
+}
@@ -8,3 +8,4 @@ int led (int, int, int);
 int led_off (int);
 int bar_led (int, int, int);
 int bar_led_off (int);
+void led_send (void *, jack_nframes_t);
@@ -0,0 +1,186 @@
+/** @file logger.c
+ *
+ * @brief Logger: the realtime thread shall not write to stderr, as a blocking write would make it miss its deadline.
+ * Its messages are sent as raw records through a lock-free ring (single producer, single consumer) to a logger thread,
+ * which formats them and writes them to stderr. Messages which are repeated are rate limited: at most LOG_BURST messages
+ * of a type are logged per second, the other ones are counted and reported in a summary.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "led.h"
+#include "time.h"
+#include "utils.h"
+#include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
+
+
+static jack_ringbuffer_t *log_ring;			// messages from realtime thread to logger thread
+static sem_t log_sem;						// logger thread waits on this for new messages
+static pthread_t log_thread_id;
+
+// rate limiting of the messages, for each type (used by realtime thread only)
+static unsigned int log_total [LAST_LOG];		// number of messages since startup
+static unsigned int log_burst [LAST_LOG];		// number of messages logged in the current second
+static unsigned int log_dropped [LAST_LOG];		// number of messages not logged in the current second
+static jack_nframes_t log_second [LAST_LOG];	// frame where the current second has started
+
+
+// write a message to stderr
+static void logger_print (log_t *msg) {
+
+	// short names of the messages, for the summaries
+	static const char *names [LAST_LOG] = {"missed event", "missed clock event", "clock input", "clock lost", "audio pool exhausted", "summary"};
+
+	switch (msg->type) {
+		case LOG_MISSED_EVENT:
+			fprintf ( stderr, "Missed %s event\n", msg->text );
+			break;
+		case LOG_MISSED_CLOCK:
+			fprintf ( stderr, "Missed clock event\n" );
+			break;
+		case LOG_CLOCK_INPUT:
+			fprintf ( stderr, "Clock input %d\n", msg->arg + 1 );
+			break;
+		case LOG_FREEWHEEL:
+			fprintf ( stderr, "Clock lost: freewheel at %.1f bpm\n", msg->value );
+			break;
+		case LOG_POOL_EXHAUSTED:
+			fprintf ( stderr, "audio pool exhausted.\n" );
+			break;
+		case LOG_SUPPRESSED:
+			fprintf ( stderr, "%u more \"%s\" messages in the last second (%u since startup)\n", msg->count, names [msg->arg], msg->total );
+			break;
+	}
+}
+
+
+// logger thread: writes the messages of the realtime thread to stderr
+static void *logger_thread (void *arg) {
+
+	log_t msg;
+
+	while (1) {
+		sem_wait (&log_sem);
+
+		while (jack_ringbuffer_read (log_ring, (char *) &msg, sizeof (log_t)) == sizeof (log_t)) logger_print (&msg);
+	}
+
+	return NULL;
+}
+
+
+// create log ring, and start logger thread
+int logger_init () {
+
+	log_ring = jack_ringbuffer_create (LOG_ELT * sizeof (log_t));
+	if (log_ring == NULL) {
+		fprintf ( stderr, "error in creating log ring.\n" );
+		exit ( 1 );
+	}
+	jack_ringbuffer_mlock (log_ring);
+	memset (log_total, 0, sizeof (log_total));
+	memset (log_burst, 0, sizeof (log_burst));
+	memset (log_dropped, 0, sizeof (log_dropped));
+	memset (log_second, 0, sizeof (log_second));
+
+	sem_init (&log_sem, 0, 0);
+	if (pthread_create (&log_thread_id, NULL, logger_thread, NULL) != 0) {
+		fprintf ( stderr, "error in creating logger thread.\n" );
+		exit ( 1 );
+	}
+
+	return 0;
+}
+
+
+/**************************************/
+/* functions for the realtime thread  */
+/**************************************/
+
+// write a message to the log ring; returns 0 if the message has not been logged (rate limit, or log ring is full)
+static int logger_write (log_t *msg) {
+
+	if (jack_ringbuffer_write_space (log_ring) < sizeof (log_t)) return 0;
+
+	jack_ringbuffer_write (log_ring, (char *) msg, sizeof (log_t));
+
+	// wake up logger thread
+	sem_post (&log_sem);
+	return 1;
+}
+
+
+// send the summary of the messages of a type which have not been logged in the current second; if log ring is full, it is sent later on
+static void logger_summary (int type) {
+
+	log_t msg;
+
+	if (log_dropped [type] == 0) return;
+
+	msg.type = LOG_SUPPRESSED;
+	msg.arg = type;
+	msg.value = 0.0;
+	msg.text = NULL;
+	msg.count = log_dropped [type];
+	msg.total = log_total [type];
+	if (logger_write (&msg)) log_dropped [type] = 0;
+}
+
+
+// send a message to the logger thread; text shall be a string constant, as it is formatted later on by the logger thread
+// returns 1 if message has been sent
+int logger_send (int type, int arg, double value, const char *text) {
+
+	log_t msg;
+	jack_nframes_t now = jack_last_frame_time (client);
+
+	// new second: messages of this type can be logged again, once the summary of the previous second is sent
+	if (now - log_second [type] >= sample_rate) {
+		logger_summary (type);
+		log_second [type] = now;
+		log_burst [type] = 0;
+	}
+
+	log_total [type]++;
+	if (log_burst [type] < LOG_BURST) {
+		msg.type = type;
+		msg.arg = arg;
+		msg.value = value;
+		msg.text = text;
+		msg.count = 0;
+		msg.total = log_total [type];
+		if (logger_write (&msg)) {
+			log_burst [type]++;
+			return 1;
+		}
+	}
+
+	log_dropped [type]++;
+	return 0;
+}
+
+
+// send the summaries of the messages which have not been logged, once their second is over; shall be called once per cycle
+int logger_flush () {
+
+	jack_nframes_t now = jack_last_frame_time (client);
+	int type;
+
+	for (type = FIRST_LOG; type < LAST_LOG; type++) {
+		if (now - log_second [type] >= sample_rate) logger_summary (type);
+	}
+
+	return 0;
+}
@@ -0,0 +1,9 @@
+/** @file logger.h
+ *
+ * @brief This file defines prototypes of functions inside logger.c
+ *
+ */
+
+int logger_init ();
+int logger_send (int, int, double, const char *);
+int logger_flush ();
@@ -12,6 +12,15 @@
 #include "time.h"
 #include "utils.h"
 #include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
 
 // For testing purpose only
 //#include <math.h>
@@ -29,8 +38,8 @@ static void init_globals ( )
 	/* INIT SOME GLOBAL VARIABLES */
 	/******************************/
 
-	/* time signature is 0, ie. 4/4 by default */
-	timesign = _4_4;
+	/* time signature is the first one of the list, ie. 4/4 by default */
+	timesign = FIRST_TIMESIGN;
 	/* number of bars to be recorded (if any specified) */
 	number_of_bars = 0;
 
@@ -39,38 +48,32 @@ static void init_globals ( )
 	ports_to_connect = calloc (255, sizeof(char*));
 	for (i=0; i<255; i++) ports_to_connect[i] = calloc (255,sizeof(char));
 
-	/* clear structure that will get control details, ie. track structure */
-	for (i = 0; i<NB_TRACKS; i++) {
-		memset (&track[i], 0, sizeof (track_t));
-		/* set volume to 1 for each track */
-		track [i].volume = 1.0f;
-
-		/* for each track, create audio buffers and fill with 0 */
-		/* we take the max size, plus add some more room (8192) to avoid overflows */
-		if ((track [i].left = calloc (NB_SAMPLES + 8192, sizeof (jack_default_audio_sample_t))) == NULL) {
-			fprintf ( stderr, "error in creating left audio buffer for track %d.\n",i);
-			exit ( 1 );
-		}
-		if ((track [i].right = calloc (NB_SAMPLES + 8192, sizeof (jack_default_audio_sample_t))) == NULL) {
-			fprintf ( stderr, "error in creating right audio buffer for track %d.\n",i);
-			exit ( 1 );
-		}
-	}
+	/* track structures are allocated once the number of tracks is known, ie. when reading config file (see init_tracks) */
 
 	/* clear structure that will get control details for bar rows, ie. bar structure */
 	for (i = 0; i<NB_BAR_ROWS; i++) {
 		memset (&bar[i], 0, sizeof (bar_t));
 	}
 
-	/* clear load/save flags */
-	is_load = FALSE;
-	is_save = FALSE;
+	/* create queue of commands between realtime thread and main thread */
+	command_init ();
+
+	/* start logger thread, which writes the messages of the realtime thread */
+	logger_init ();
+
+	/* tempo estimator of the midi clock */
+	tempo_init (&tempo, TEMPO_BANDWIDTH);
+
+	/* table used to compute checksums of session files */
+	crc_init ();
 
 }
 
 
 static void signal_handler ( int sig )
 {
+	/* midi stop is sent to the gear following the clock output */
+	clock_stop ();
 	jack_client_close ( client );
 	fprintf ( stderr, "signal received, exiting ...\n" );
 	exit ( 0 );
@@ -83,19 +86,23 @@ static void signal_handler ( int sig )
  */
 void jack_shutdown ( void *arg )
 {
+	int i;
+
 	free ( input_ports );
 	free ( output_ports );
 	free (midi_input_port);
 	free (midi_output_port);
-	free (clock_input_port);
+	for (i = 0; i < nb_clock_inputs; i++) free (clock_input_ports[i]);
+	free (clock_output_port);
 	exit ( 1 );
 }
 
-/* usage: boocli (config_file) (jack client name) (jack server name)*/
+/* usage: boocli [-t number_of_tracks] (ppbar) (config_file) (jack client name) (jack server name)*/
 
 int main ( int argc, char *argv[] )
 {
-	int i;
+	int i, opt;
+	command_t cmd;
 	const char *client_name;
 	const char *server_name = NULL;
 	char *config_name;
@@ -112,11 +119,34 @@ int main ( int argc, char *argv[] )
 	config_name = calloc (20, sizeof(char));
 	strcpy (config_name, "./boocli.cfg");
 
+	/* options: number of tracks (overrides the value of the config file) */
+	while ((opt = getopt (argc, argv, "t:")) != -1) {
+		switch (opt) {
+			case 't':
+				nb_tracks = atoi (optarg);
+				if ((nb_tracks < 1) || (nb_tracks > MAX_TRACKS)) {
+					fprintf ( stderr, "number of tracks shall be between 1 and %d.\n", MAX_TRACKS );
+					exit ( 1 );
+				}
+				break;
+			default:
+				fprintf ( stderr, "usage: %s [-t number_of_tracks] (ppbar) (config_file) (jack client name) (jack server name)\n", argv[0] );
+				exit ( 1 );
+		}
+	}
+	/* remove options, so positional arguments start at argv [1] */
+	argc -= (optind - 1);
+	argv += (optind - 1);
+
 	/* pulse per BAR is set to standard value, ie. 4 * 24 = 96 pulse per bar */
 	ppbar = MIDI_CLOCK_RATE;
 	// PP per bar
 	if ( argc >=2 ) {
-		ppbar = atof (argv [1]);
+		ppbar = atoi (argv [1]);
+		if ((ppbar < 1) || (ppbar > MAX_PPBAR)) {
+			fprintf ( stderr, "ppbar shall be between 1 and %d.\n", MAX_PPBAR );
+			exit ( 1 );
+		}
 	}
 
 	if ( argc >=3 ) {
@@ -164,6 +194,9 @@ int main ( int argc, char *argv[] )
 	sample_rate = jack_get_sample_rate(client);
 	nb_frames_per_packet =  jack_get_buffer_size(client);
 
+	/* display mix kernels used for playback (these are selected at compile time) */
+	fprintf ( stderr, "mix kernel: %s.\n", mix_kernel () );
+
 	/* set callback function to process jack events */
 	jack_set_process_callback ( client, process, 0 );
 
@@ -187,9 +220,9 @@ int main ( int argc, char *argv[] )
 		exit ( 1 );
 	}
 
-	/* register clock-input port: this port will get the midi clock notification */
-	clock_input_port = jack_port_register (client, "clock_input_1", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
-	if (clock_input_port == NULL ) {
+	/* register clock-output port: this port sends the midi clock of the clock source (eg. internal clock), so other gear can follow boocli */
+	clock_output_port = jack_port_register (client, "clock_output_1", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+	if (clock_output_port == NULL ) {
 		fprintf ( stderr, "no more JACK MIDI ports available.\n" );
 		exit ( 1 );
 	}
@@ -213,15 +246,6 @@ int main ( int argc, char *argv[] )
 		}
 	}
 
-	/* Tell the JACK server that we are ready to roll.  Our
-	 * process() callback will start running now. */
-
-	if ( jack_activate ( client ) )
-	{
-		fprintf ( stderr, "cannot activate client.\n" );
-		exit ( 1 );
-	}
-
 	/* init global variables */
 	init_globals();
 
@@ -231,10 +255,57 @@ int main ( int argc, char *argv[] )
 	/**************/
 
 	/* read config file to get all the parameters */
+	/* this is done before activating the client, as track structures are allocated while reading config file */
 	if (read_config (config_name)==EXIT_FAILURE) {
 		fprintf ( stderr, "error in reading config file.\n" );
 		exit ( 1 );
 	}
+	fprintf ( stderr, "number of tracks: %d.\n", nb_tracks );
+
+	/* register clock-input ports (clock_input_1, clock_input_2...): these ports will get the midi clock notification */
+	/* this is done once the number of clock inputs is known, ie. after reading config file */
+	for (i = 0; i < nb_clock_inputs; i++) {
+		sprintf ( port_name, "clock_input_%d", i + 1 );
+		clock_input_ports[i] = jack_port_register (client, port_name, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+		if (clock_input_ports[i] == NULL ) {
+			fprintf ( stderr, "no more JACK MIDI ports available.\n" );
+			exit ( 1 );
+		}
+	}
+
+	/* tick table of the first time signature of the list */
+	set_timesign (FIRST_TIMESIGN);
+
+	/* with JACK transport as clock source, boocli may be the timebase master */
+	clock_init ();
+
+	/* allocate audio pool, where recorded audio is stored: memory of the pool is touched and locked */
+	pool_init (pool_size);
+
+	/* start write-behind recorder, which writes recorded audio to take files while recording */
+	recorder_init ();
+
+	/* spare audio buffers, where tracks are time-stretched in the background */
+	stretch_init ();
+
+	/* shared memory block of the timing statistics of the process callback, and xrun callback */
+	stats_init ();
+
+	/* lock all the other memory used so far (track structures, led requests...), so realtime thread never has a page fault */
+	/* this is done before activating the client, as process() callback will start running right after */
+	if (mlockall (MCL_CURRENT) != 0) {
+		fprintf ( stderr, "cannot lock memory (%s); check memlock limit in /etc/security/limits.conf.\n", strerror (errno) );
+	}
+	fprintf ( stderr, "memory ready.\n" );
+
+	/* Tell the JACK server that we are ready to roll.  Our
+	 * process() callback will start running now. */
+
+	if ( jack_activate ( client ) )
+	{
+		fprintf ( stderr, "cannot activate client.\n" );
+		exit ( 1 );
+	}
 
 	/* Connect the ports.  You can't do this before the client is
 	 * activated, because we can't make connections to clients
@@ -277,7 +348,7 @@ int main ( int argc, char *argv[] )
 
 
 	/* switch all leds off for all the tracks */
-	for (i = 0; i<NB_TRACKS; i++) {
+	for (i = 0; i<nb_tracks; i++) {
 		/* set structure that contains status for each pad led to ON : this is to force all leds off */
 		memset (&led_status[i][0], ON, LAST_ELT);
 
@@ -324,48 +395,42 @@ int main ( int argc, char *argv[] )
 */
 
 	/* keep running until the transport stops */
+	/* main thread performs the slow operations (load, save...) requested by the realtime thread */
 
 	while (1)
 	{
-		// load pad has been pressed
-		if (is_load) {
-
-			load ();
-			is_load = FALSE;
-
-			// reset status of all the tracks, to have a fresh start
-			for (i = 0; i < NB_TRACKS; i++) {
-
-				// reset track status
-				reset_status (&track[i]);
-				// reset volume to max
-				track[i].volume = 1.0f;
-				// switch all leds off for the track
-				led_off (i);
-				// track volume set to 1.0 by default
-				led (i, VOLUP, ON);
-
-			}
-
-			// load led off
-			led (0, LOAD, OFF);
+		// wait for next command from realtime thread
+		command_wait (&cmd);
+
+		switch (cmd.type) {
+			// load pad has been pressed
+			case CMD_LOAD:
+				cmd.arg = load ();
+				break;
+			// save pad has been pressed
+			case CMD_SAVE:
+				save ();
+				break;
+			// shadow tracks have been swapped with the tracks after a load
+			case CMD_RECYCLE:
+				recycle ();
+				break;
+			// stretch pad has been pressed: render the track again, at the bar length of the current tempo
+			case CMD_STRETCH:
+				cmd.arg = stretch ();
+				break;
+			// stretched track has been swapped with the track
+			case CMD_UNSTRETCH:
+				unstretch ();
+				break;
+			// a track no longer uses its mapped session file
+			case CMD_UNMAP:
+				unmap (cmd.arg);
+				break;
 		}
 
-		// save pad has been pressed
-		if (is_save) {
-
-			save ();
-			is_save = FALSE;
-
-			// save led off
-			led (0, SAVE, OFF);
-		}
-
-#ifdef WIN32
-		Sleep ( 1000 );
-#else
-		sleep ( 1 );
-#endif
+		// command is done: realtime thread will complete it (leds, etc); notifications get no reply
+		if (cmd.type < FIRST_NOTIFY) command_reply (cmd.type, cmd.arg);
 	}
 
 	jack_client_close ( client );
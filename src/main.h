@@ -14,7 +14,8 @@ jack_port_t **input_ports;
 jack_port_t **output_ports;
 jack_port_t *midi_input_port;
 jack_port_t *midi_output_port;
-jack_port_t *clock_input_port;
+jack_port_t *clock_input_ports [CLOCK_INPUTS];
+jack_port_t *clock_output_port;
 char **ports_to_connect;
 
 /* define JACKD client : this is this program */
@@ -24,9 +25,17 @@ jack_client_t *client;
 uint32_t nb_frames_per_packet, sample_rate;
 
 /* define the structures for managing leds of midi control surface */
-unsigned char list_buffer[LIST_ELT][4];	// list buffer of LIST_ELT led request
-unsigned char list_index = 0;			// index where to write led request to
-unsigned char led_status [NB_TRACKS][LAST_ELT]; 	// this table will contain whether each light is on/off at a time; this is to avoid sending led requests which are not required
+unsigned short *list_buffer;			// ring of led requests: a request is the number of a led, and each led is at most once in the ring, so that it never overflows
+int list_size;							// number of leds, ie. number of led requests the ring can contain
+int list_read = 0;						// index where to read next led request from
+int list_count = 0;						// number of led requests in the ring
+unsigned char *list_queued;				// for each led, whether there is a request for it in the ring
+unsigned char *list_sent;				// for each led, last state sent to the control surface
+int led_rate = LED_RATE;				// maximum number of led messages per second sent to the control surface (0: no limit)
+int led_output = LED_MIDI;				// led output: midi messages, or bulk SysEx messages
+unsigned char led_sysex [LED_SYSEX] = {0x00, 0x20, 0x29, 0x02, 0x18, 0x0A};	// header of the bulk SysEx message, after 0xF0 (default: Launchpad MK2 "set leds")
+int led_sysex_size = 6;					// size of the header of the bulk SysEx message
+unsigned char (*led_status)[LAST_ELT]; 	// this table will contain whether each light is on/off at a time; this is to avoid sending led requests which are not required
 
 unsigned char bar_led_status [NB_BAR_ROWS][LAST_BAR_ELT]; 	// this table will contain whether each light is on/off at a time for a bar row; this is to avoid sending led requests which are not required
 int number_of_bars;		// this value indicates the number of bars to be recorded (when specified and not 0
@@ -43,15 +52,41 @@ int is_BBT=PENDING_ON; 	// OFF: no new bar, ON: new bar, PENDING_ON: (play event
 
 int timesign;			// the value of this variable indicates which is the current time signature
 
+/* number of tracks of the looper: set from command line or config file (0 means not set yet) */
+int nb_tracks = 0;
 /* define track structure for each track of the looper */
-track_t track [NB_TRACKS];
+track_t *track;
+/* shadow tracks: a session is loaded in these in the background, then swapped with the tracks at the next bar */
+track_t *shadow;
+int is_swap = OFF;		// OFF: no swap, PENDING_ON: shadow tracks are loaded and will be swapped at next bar, PENDING_OFF: swap done, previous audio buffers are being released
+/* saved tracks: snapshot of the tracks taken when the save pad is pressed, which main thread writes to the session files */
+track_t *saved;
+int is_paused = FALSE;	// TRUE after midi stop: tracks neither play nor record, and clock ticks are ignored, until midi continue (or play)
+int is_seek = OFF;		// ON: song position has changed (midi play, song position pointer): playing tracks are moved to the new position at next clock event
 /* define bar row structure */
 bar_t bar [NB_BAR_ROWS];
 
-/* load & save globals */
-int is_load;
-int is_save;
+/* tempo estimator of the midi clock */
+tempo_t tempo;
+/* playback resampling: loops follow the tempo of the clock */
+int is_resample = FALSE;
+/* clock source (midi clock, JACK transport or internal clock), and initial tempo when boocli is the clock master (internal clock, or timebase master of JACK transport) */
+int clock_source = CLOCK_MIDI;
+/* number of midi clock input ports, and primary input (the active clock, whenever it is good) */
+int nb_clock_inputs = 1;
+int clock_primary = 0;
+int is_timebase = FALSE;
+double master_bpm = MASTER_BPM;
+
+/* size of the audio pool, in MB, and huge pages used for the audio pool */
+int pool_size = POOL_SIZE;
+int hugepages = HUGEPAGES_OFF;
+/* mmap mode: loaded tracks are read from their session files mapped in memory, instead of being copied to the audio pool */
+int is_mmap = FALSE;
+
+/* timing statistics of the process callback, published in a shared memory block */
+int is_stats = FALSE;
 
 /* PPBAR can vary from 96 to 99, depending on the attached midi clock device */
-float ppbar;
+int ppbar;				// number of clock ticks per whole note
 
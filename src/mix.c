@@ -0,0 +1,404 @@
+/** @file mix.c
+ *
+ * @brief Mix engine: plays (and records) the active tracks of the looper in a single pass per audio cycle.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "led.h"
+#include "time.h"
+#include "utils.h"
+#include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
+
+// select the best mix kernels for the host we are compiled for (see makefile for compiler flags)
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MIX_KERNEL "neon"
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define MIX_KERNEL "avx"
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#define MIX_KERNEL "sse"
+#else
+#define MIX_KERNEL "scalar"
+#endif
+
+
+/****************/
+/* mix kernels  */
+/****************/
+
+// limit a sample to the boundaries {-1.0, +1.0}
+static inline jack_default_audio_sample_t clip (jack_default_audio_sample_t x) {
+
+	if (x > 1.0f) return 1.0f;
+	if (x < -1.0f) return -1.0f;
+	return x;
+}
+
+
+// mix kernel: out += src * gain
+static void mix_add (jack_default_audio_sample_t *out, const jack_default_audio_sample_t *src, jack_default_audio_sample_t gain, jack_nframes_t nframes) {
+
+	jack_nframes_t k = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	for (; k + 4 <= nframes; k += 4) {
+		vst1q_f32 (out + k, vmlaq_n_f32 (vld1q_f32 (out + k), vld1q_f32 (src + k), gain));
+	}
+#elif defined(__AVX__)
+	__m256 g = _mm256_set1_ps (gain);
+	for (; k + 8 <= nframes; k += 8) {
+		_mm256_storeu_ps (out + k, _mm256_add_ps (_mm256_loadu_ps (out + k), _mm256_mul_ps (_mm256_loadu_ps (src + k), g)));
+	}
+#elif defined(__SSE__)
+	__m128 g = _mm_set1_ps (gain);
+	for (; k + 4 <= nframes; k += 4) {
+		_mm_storeu_ps (out + k, _mm_add_ps (_mm_loadu_ps (out + k), _mm_mul_ps (_mm_loadu_ps (src + k), g)));
+	}
+#endif
+	// scalar fallback, and remaining samples
+	for (; k < nframes; k++) out [k] += src [k] * gain;
+}
+
+
+// mix kernel: out = clip (out + src * gain); used for the last track to be mixed, so mix, gain and clip are done in one pass
+static void mix_add_clip (jack_default_audio_sample_t *out, const jack_default_audio_sample_t *src, jack_default_audio_sample_t gain, jack_nframes_t nframes) {
+
+	jack_nframes_t k = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	float32x4_t hi = vdupq_n_f32 (1.0f);
+	float32x4_t lo = vdupq_n_f32 (-1.0f);
+	for (; k + 4 <= nframes; k += 4) {
+		float32x4_t x = vmlaq_n_f32 (vld1q_f32 (out + k), vld1q_f32 (src + k), gain);
+		vst1q_f32 (out + k, vmaxq_f32 (vminq_f32 (x, hi), lo));
+	}
+#elif defined(__AVX__)
+	__m256 g = _mm256_set1_ps (gain);
+	__m256 hi = _mm256_set1_ps (1.0f);
+	__m256 lo = _mm256_set1_ps (-1.0f);
+	for (; k + 8 <= nframes; k += 8) {
+		__m256 x = _mm256_add_ps (_mm256_loadu_ps (out + k), _mm256_mul_ps (_mm256_loadu_ps (src + k), g));
+		_mm256_storeu_ps (out + k, _mm256_max_ps (_mm256_min_ps (x, hi), lo));
+	}
+#elif defined(__SSE__)
+	__m128 g = _mm_set1_ps (gain);
+	__m128 hi = _mm_set1_ps (1.0f);
+	__m128 lo = _mm_set1_ps (-1.0f);
+	for (; k + 4 <= nframes; k += 4) {
+		__m128 x = _mm_add_ps (_mm_loadu_ps (out + k), _mm_mul_ps (_mm_loadu_ps (src + k), g));
+		_mm_storeu_ps (out + k, _mm_max_ps (_mm_min_ps (x, hi), lo));
+	}
+#endif
+	// scalar fallback, and remaining samples
+	for (; k < nframes; k++) out [k] = clip (out [k] + src [k] * gain);
+}
+
+
+// returns the name of the mix kernels selected at compile time
+const char *mix_kernel () {
+
+	return MIX_KERNEL;
+}
+
+
+/****************/
+/* mix engine   */
+/****************/
+
+
+// returns the mask of tracks that can be heard during this cycle (bit j set means track j is heard)
+// a track is not heard if it has mute button, or if another track is in solo mode
+unsigned int audible_tracks () {
+
+	int j;
+	unsigned int solo = 0;
+	unsigned int mask = 0;
+
+	// first pass: get the tracks which are in solo mode
+	for (j = 0; j < nb_tracks; j++) {
+		if (track[j].status[SOLO] == ON) solo |= (1u << j);
+	}
+
+	// second pass: a track is heard if not muted and no other track is in solo mode
+	for (j = 0; j < nb_tracks; j++) {
+		if (track[j].status[MUTE] == ON) continue;
+		if (solo & ~(1u << j)) continue;
+		mask |= (1u << j);
+	}
+
+	return mask;
+}
+
+
+// returns the mask of tracks that are playing during this cycle (bit j set means track j is playing)
+unsigned int playing_tracks () {
+
+	int j;
+	unsigned int mask = 0;
+
+	for (j = 0; j < nb_tracks; j++) {
+		// test if play is on or pending_off (ie. still on)
+		if ((track[j].status[PLAY] == ON) || (track[j].status[PLAY] == PENDING_OFF)) mask |= (1u << j);
+	}
+
+	return mask;
+}
+
+
+// returns the mask of tracks that are recording during this cycle (bit j set means track j is recording)
+unsigned int recording_tracks () {
+
+	int j;
+	unsigned int mask = 0;
+
+	for (j = 0; j < nb_tracks; j++) {
+		// test if record is on or pending_off (ie. still on)
+		if ((track[j].status[RECORD] == ON) || (track[j].status[RECORD] == PENDING_OFF)) mask |= (1u << j);
+	}
+
+	return mask;
+}
+
+
+// mix nframes samples of a track buffer, starting at "index", into out
+// if this is the last track to be mixed during this cycle, out is clipped at the same time
+static void mix_channel (jack_default_audio_sample_t *out, jack_default_audio_sample_t **buffer, jack_nframes_t index, jack_default_audio_sample_t last_sample, jack_default_audio_sample_t volume, jack_nframes_t nframes, int last) {
+
+	jack_nframes_t k = 0;
+	jack_nframes_t n;
+	jack_default_audio_sample_t sample, target;
+	jack_default_audio_sample_t *src;
+
+	// audio crack removal mechanism
+	// this is basically making sure that the end of recording (last sample) corresponds to the start of recording (first sample).
+	// so when we play the start of recording (ie. new loop), we allocate CROSSFADE samples to make a linear progression between last sample value and first sample value
+	// as a cycle may be split at the time of midi events, the crossfade may be done over several parts of the cycle (last_sample is kept until crossfade is done)
+	// this is done apart from the mix kernels, so these do not have to test for it at each sample
+	if (index <= CROSSFADE) {
+		target = pool_sample (buffer, CROSSFADE);
+		for (k = 0; (k < nframes) && (index + k <= CROSSFADE); k++) {
+			sample = last_sample + ((target - last_sample) * ((float) (index + k) / (float) CROSSFADE));
+			out [k] += sample * volume;
+			if (last) out [k] = clip (out [k]);
+		}
+	}
+
+	// mix the rest of the samples with the mix kernels, one block of the track buffer at a time
+	while (k < nframes) {
+		n = nframes - k;
+		src = pool_span (buffer, index + k, &n);
+		if (src != NULL) {
+			if (last) mix_add_clip (out + k, src, volume, n);
+			else mix_add (out + k, src, volume, n);
+		}
+		// no block means silence: nothing to mix, but clipping is still required
+		else if (last) mix_clip (out + k, n);
+		k += n;
+	}
+}
+
+
+// play nframes samples of a channel of a track from *index, and move *index forward
+// playback wraps at the exact end of the recording (end_index), which may be in the middle of the cycle
+static void play_channel (jack_default_audio_sample_t *out, jack_default_audio_sample_t **buffer, jack_nframes_t *index, jack_default_audio_sample_t *last_sample, jack_nframes_t end_index, jack_default_audio_sample_t volume, jack_nframes_t nframes, int audible, int last) {
+
+	jack_nframes_t n;
+
+	if ((end_index == 0) || (end_index > NB_SAMPLES)) end_index = NB_SAMPLES;
+
+	while (nframes > 0) {
+		// loop has been shortened (end_index) while playing
+		if (*index >= end_index) *index = 0;
+
+		// play up to the end of the loop
+		n = end_index - *index;
+		if (n > nframes) n = nframes;
+		if (audible) mix_channel (out, buffer, *index, *last_sample, volume, n, last);
+
+		// set new value for last sample : this is the last sample to be played
+		// this is kept during the crossfade at the start of the loop
+		if (*index + n > CROSSFADE) *last_sample = pool_sample (buffer, *index + n - 1);
+
+		// increment index and check if not over end of the recording
+		*index += n;
+		if (*index >= end_index) *index = 0;
+		out += n;
+		nframes -= n;
+	}
+}
+
+
+// sample "index" of a loop of "end_index" samples (index may be out of the loop: loop is repeated)
+static inline jack_default_audio_sample_t loop_sample (jack_default_audio_sample_t **buffer, long index, jack_nframes_t end_index) {
+
+	if (index < 0) index += end_index;
+	else if (index >= (long) end_index) index -= end_index;
+	return pool_sample (buffer, (jack_nframes_t) index);
+}
+
+
+// play nframes samples of a channel of a track from *index + *frac at "ratio" samples per frame (resampling), and move *index, *frac forward
+// samples are interpolated with a cubic hermite (catmull-rom) interpolation: cost is the same for each frame, whatever the ratio
+// the loop is continuous (samples after the end are the first ones), so there is no crossfade at the start of the loop
+static void play_channel_resample (jack_default_audio_sample_t *out, jack_default_audio_sample_t **buffer, jack_nframes_t *index, double *frac, jack_default_audio_sample_t *last_sample, jack_nframes_t end_index, jack_default_audio_sample_t volume, double ratio, jack_nframes_t nframes, int audible, int last) {
+
+	jack_nframes_t k;
+	long i;
+	float f, xm1, x0, x1, x2, c1, c2, c3;
+	double pos = *frac;
+
+	if ((end_index == 0) || (end_index > NB_SAMPLES)) end_index = NB_SAMPLES;
+	if (*index >= end_index) *index = 0;
+	i = *index;
+
+	for (k = 0; k < nframes; k++) {
+		if (audible) {
+			f = (float) pos;
+			xm1 = loop_sample (buffer, i - 1, end_index);
+			x0 = loop_sample (buffer, i, end_index);
+			x1 = loop_sample (buffer, i + 1, end_index);
+			x2 = loop_sample (buffer, i + 2, end_index);
+			c1 = 0.5f * (x1 - xm1);
+			c2 = xm1 - (2.5f * x0) + (2.0f * x1) - (0.5f * x2);
+			c3 = (0.5f * (x2 - xm1)) + (1.5f * (x0 - x1));
+			out [k] += ((((c3 * f) + c2) * f + c1) * f + x0) * volume;
+			if (last) out [k] = clip (out [k]);
+		}
+
+		// move forward by ratio samples
+		pos += ratio;
+		i += (long) pos;
+		pos -= floor (pos);
+		while (i >= (long) end_index) i -= end_index;
+	}
+
+	*index = (jack_nframes_t) i;
+	*frac = pos;
+	// last sample played, in case resampling stops
+	*last_sample = loop_sample (buffer, i - 1, end_index);
+}
+
+
+// playback rate of a track when resampling: smoothed ratio of the tempo of the clock to the tempo of the recording
+// returns 0 if track shall not be resampled, or if its rate is close enough to 1 to be played with a plain copy
+static double resample_ratio (track_t *t) {
+
+	if (!is_resample || (t->play_ratio <= 0.0) || (fabs (t->play_ratio - 1.0) < RESAMPLE_DEADBAND)) return 0.0;
+	return t->play_ratio;
+}
+
+
+// update the playback rates of the tracks from the tempo estimator; shall be called once per cycle
+// rates follow the tempo through a one-pole filter, with a limited change per cycle, so the jitter of the clock does not make the pitch wobble
+void resample_update () {
+
+	track_t *t;
+	double ratio, step;
+	int j;
+
+	for (j = 0; j < nb_tracks; j++) {
+		t = &track[j];
+		if (!is_resample || (t->record_spt <= 0.0) || !tempo_locked (&tempo)) {
+			t->play_ratio = 0.0;
+			continue;
+		}
+
+		ratio = t->record_spt / tempo_spt (&tempo);
+		if (ratio < RESAMPLE_MIN) ratio = RESAMPLE_MIN;
+		if (ratio > RESAMPLE_MAX) ratio = RESAMPLE_MAX;
+
+		// first cycle with a known rate: start at the rate of the clock
+		if (t->play_ratio <= 0.0) {
+			t->play_ratio = ratio;
+			continue;
+		}
+
+		step = (ratio - t->play_ratio) * RESAMPLE_SMOOTH;
+		if (step > RESAMPLE_SLEW) step = RESAMPLE_SLEW;
+		if (step < -RESAMPLE_SLEW) step = -RESAMPLE_SLEW;
+		t->play_ratio += step;
+	}
+}
+
+
+// play track j: left and right buffers of the track are mixed into out_left, out_right
+// if track is not audible, play indexes are moved forward but nothing is mixed
+// if track is the last one to be mixed during this cycle, out_left and out_right are clipped at the same time
+// looping at a new bar (bar mode) is done when processing the clock event of the bar
+void mix_track (int j, jack_default_audio_sample_t *out_left, jack_default_audio_sample_t *out_right, jack_nframes_t nframes, int audible, int last) {
+
+	track_t *t = &track[j];
+	double ratio = resample_ratio (t);
+
+	// tempo of the clock differs from the tempo of the recording: loop is resampled so it still fits the bars
+	if (ratio > 0.0) {
+		play_channel_resample (out_left, t->left, &t->play_index_left, &t->play_frac_left, &t->last_sample_left, t->end_index_left, t->volume, ratio, nframes, audible, last);
+		play_channel_resample (out_right, t->right, &t->play_index_right, &t->play_frac_right, &t->last_sample_right, t->end_index_right, t->volume, ratio, nframes, audible, last);
+		return;
+	}
+
+	// plain copy: play position is a whole sample
+	t->play_frac_left = 0.0;
+	t->play_frac_right = 0.0;
+
+	play_channel (out_left, t->left, &t->play_index_left, &t->last_sample_left, t->end_index_left, t->volume, nframes, audible, last);
+	play_channel (out_right, t->right, &t->play_index_right, &t->last_sample_right, t->end_index_right, t->volume, nframes, audible, last);
+}
+
+
+// record track j: audio in (left and right) is copied to the track buffers
+// blocks of the track buffers are taken from the audio pool when required
+void record_track (int j, jack_default_audio_sample_t *in_left, jack_default_audio_sample_t *in_right, jack_nframes_t nframes) {
+
+	track_t *t = &track[j];
+
+	// copy input to record buffer
+	pool_write (t->left, t->record_index_left, in_left, nframes);
+	pool_write (t->right, t->record_index_right, in_right, nframes);
+
+	// stream input to the take file (see recorder)
+	recorder_write (j, t->record_index_left, in_left, in_right, nframes);
+
+	// increment index and check if not overflow
+	t->record_index_left = (t->record_index_left >= NB_SAMPLES) ? 0 : (t->record_index_left + nframes);
+	t->record_index_right = (t->record_index_right >= NB_SAMPLES) ? 0 : (t->record_index_right + nframes);
+}
+
+
+// check if out audio buffer is not out of boundaries {-1.0, +1.0} to limit saturation
+// this is only required when no track has been mixed during this cycle (otherwise it is done by mix_add_clip)
+void mix_clip (jack_default_audio_sample_t *out, jack_nframes_t nframes) {
+
+	jack_nframes_t h = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	float32x4_t hi = vdupq_n_f32 (1.0f);
+	float32x4_t lo = vdupq_n_f32 (-1.0f);
+	for (; h + 4 <= nframes; h += 4) vst1q_f32 (out + h, vmaxq_f32 (vminq_f32 (vld1q_f32 (out + h), hi), lo));
+#elif defined(__AVX__)
+	__m256 hi = _mm256_set1_ps (1.0f);
+	__m256 lo = _mm256_set1_ps (-1.0f);
+	for (; h + 8 <= nframes; h += 8) _mm256_storeu_ps (out + h, _mm256_max_ps (_mm256_min_ps (_mm256_loadu_ps (out + h), hi), lo));
+#elif defined(__SSE__)
+	__m128 hi = _mm_set1_ps (1.0f);
+	__m128 lo = _mm_set1_ps (-1.0f);
+	for (; h + 4 <= nframes; h += 4) _mm_storeu_ps (out + h, _mm_max_ps (_mm_min_ps (_mm_loadu_ps (out + h), hi), lo));
+#endif
+	// scalar fallback, and remaining samples
+	for (; h < nframes; h++) out [h] = clip (out [h]);
+}
@@ -0,0 +1,14 @@
+/** @file mix.h
+ *
+ * @brief This file defines prototypes of functions inside mix.c
+ *
+ */
+
+unsigned int audible_tracks ();
+unsigned int playing_tracks ();
+unsigned int recording_tracks ();
+void mix_track (int, jack_default_audio_sample_t *, jack_default_audio_sample_t *, jack_nframes_t, int, int);
+void record_track (int, jack_default_audio_sample_t *, jack_default_audio_sample_t *, jack_nframes_t);
+void mix_clip (jack_default_audio_sample_t *, jack_nframes_t);
+void resample_update ();
+const char *mix_kernel ();
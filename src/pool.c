@@ -0,0 +1,336 @@
+/** @file pool.c
+ *
+ * @brief Audio pool: track buffers are made of fixed-size blocks of samples, taken from a pool which is allocated at startup.
+ * Blocks are handed to the realtime thread through a lock-free ring, which is kept full by a (non realtime) pool thread.
+ * Blocks which are not used anymore are given back to the pool thread through another lock-free ring.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "led.h"
+#include "time.h"
+#include "utils.h"
+#include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
+
+
+static jack_default_audio_sample_t *pool_memory;		// memory of the pool, where all the blocks are
+static jack_default_audio_sample_t **reserve;			// blocks that are free, and not yet given to the realtime thread
+static int reserve_count;								// number of blocks in the reserve
+static pthread_mutex_t reserve_mutex = PTHREAD_MUTEX_INITIALIZER;	// protects the reserve, which is only used by non realtime threads
+static jack_ringbuffer_t *free_ring;					// blocks ready to be used by the realtime thread
+static jack_ringbuffer_t *release_ring;					// blocks released by the realtime thread
+static sem_t pool_sem;									// wakes up the pool thread
+static pthread_t pool_thread_id;
+static int is_exhausted = FALSE;						// used to report pool exhaustion only once
+static jack_default_audio_sample_t **deferred;			// blocks released by the realtime thread while the pool is pinned (see pool_pin)
+static int deferred_count;								// number of blocks in deferred
+static int is_pinned = FALSE;							// TRUE while main thread saves the tracks from a snapshot of their buffers
+
+
+// pool thread: gets back the blocks released by the realtime thread, and keeps the ring of free blocks full
+static void *pool_thread (void *arg) {
+
+	jack_default_audio_sample_t *block;
+
+	while (1) {
+		sem_wait (&pool_sem);
+
+		// get back the blocks released by the realtime thread: clear them, and put them in the reserve
+		while (jack_ringbuffer_read (release_ring, (char *) &block, sizeof (block)) == sizeof (block)) {
+			memset (block, 0, POOL_BLOCK * sizeof (jack_default_audio_sample_t));
+			pthread_mutex_lock (&reserve_mutex);
+			reserve [reserve_count++] = block;
+			pthread_mutex_unlock (&reserve_mutex);
+		}
+
+		// fill the ring of blocks available for the realtime thread
+		pthread_mutex_lock (&reserve_mutex);
+		while ((reserve_count > 0) && (jack_ringbuffer_write_space (free_ring) >= sizeof (block))) {
+			block = reserve [--reserve_count];
+			jack_ringbuffer_write (free_ring, (char *) &block, sizeof (block));
+		}
+		pthread_mutex_unlock (&reserve_mutex);
+	}
+
+	return NULL;
+}
+
+
+// allocate the memory of the pool, using huge pages if requested; returns NULL in case of failure
+static void *pool_map (size_t length) {
+
+	void *memory;
+
+#ifdef MAP_HUGETLB
+	// explicit huge pages: these shall be reserved by the system, if not we fall back to standard pages
+	if (hugepages == HUGEPAGES_EXPLICIT) {
+		memory = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (memory != MAP_FAILED) {
+			fprintf ( stderr, "audio pool: using explicit huge pages.\n" );
+			return memory;
+		}
+		fprintf ( stderr, "audio pool: no explicit huge pages available (check /proc/sys/vm/nr_hugepages), using standard pages.\n" );
+	}
+#endif
+
+	memory = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) return NULL;
+
+#ifdef MADV_HUGEPAGE
+	// transparent huge pages: this is just a hint to the kernel
+	if (hugepages == HUGEPAGES_TRANSPARENT) {
+		if (madvise (memory, length, MADV_HUGEPAGE) == 0) fprintf ( stderr, "audio pool: using transparent huge pages.\n" );
+		else fprintf ( stderr, "audio pool: transparent huge pages not available, using standard pages.\n" );
+	}
+#endif
+
+	return memory;
+}
+
+
+// allocate the pool (size in MB), pre-fault and lock all its memory, and start pool thread
+// this shall be done before activating jack client, so realtime thread never has a page fault when using the pool
+int pool_init (int size) {
+
+	int i;
+	int nb_blocks;
+	int percent, previous_percent = -1;
+	size_t length;
+
+	nb_blocks = (int) (((size_t) size * 1024 * 1024) / (POOL_BLOCK * sizeof (jack_default_audio_sample_t)));
+	if (nb_blocks < 1) nb_blocks = 1;
+
+	/* allocate the memory of the pool, and the reserve which gives the free blocks */
+	/* size is rounded to a number of huge pages */
+	length = ((size_t) nb_blocks * POOL_BLOCK * sizeof (jack_default_audio_sample_t) + HUGEPAGE_SIZE - 1) & ~((size_t) HUGEPAGE_SIZE - 1);
+	pool_memory = pool_map (length);
+	reserve = calloc (nb_blocks, sizeof (jack_default_audio_sample_t *));
+	deferred = calloc (nb_blocks, sizeof (jack_default_audio_sample_t *));
+	if ((pool_memory == NULL) || (reserve == NULL) || (deferred == NULL)) {
+		fprintf ( stderr, "error in creating audio pool of %d MB.\n", size );
+		exit ( 1 );
+	}
+
+	/* touch all the memory of the pool, so there is no page fault when realtime thread uses it */
+	for (i = 0; i < nb_blocks; i++) {
+		reserve [i] = pool_memory + ((size_t) i * POOL_BLOCK);
+		memset (reserve [i], 0, POOL_BLOCK * sizeof (jack_default_audio_sample_t));
+
+		// report progress, as this may take a few seconds on a small device
+		percent = ((i + 1) * 100) / nb_blocks;
+		if ((percent / 10) != (previous_percent / 10)) fprintf ( stderr, "audio pool: preparing memory... %d%%\n", percent );
+		previous_percent = percent;
+	}
+	reserve_count = nb_blocks;
+
+	/* lock the memory of the pool, so it is never swapped out */
+	if (mlock (pool_memory, length) != 0) {
+		fprintf ( stderr, "audio pool: cannot lock memory (%s); check memlock limit in /etc/security/limits.conf.\n", strerror (errno) );
+	}
+
+	/* create the rings between pool thread and realtime thread: release ring can get all the blocks of the pool */
+	free_ring = jack_ringbuffer_create (POOL_RT_BLOCKS * sizeof (jack_default_audio_sample_t *));
+	release_ring = jack_ringbuffer_create ((size_t) nb_blocks * sizeof (jack_default_audio_sample_t *));
+	if ((free_ring == NULL) || (release_ring == NULL)) {
+		fprintf ( stderr, "error in creating audio pool rings.\n" );
+		exit ( 1 );
+	}
+	jack_ringbuffer_mlock (free_ring);
+	jack_ringbuffer_mlock (release_ring);
+	mlock (deferred, nb_blocks * sizeof (jack_default_audio_sample_t *));
+
+	/* start pool thread, and have it fill the ring of free blocks */
+	sem_init (&pool_sem, 0, 0);
+	if (pthread_create (&pool_thread_id, NULL, pool_thread, NULL) != 0) {
+		fprintf ( stderr, "error in creating audio pool thread.\n" );
+		exit ( 1 );
+	}
+	sem_post (&pool_sem);
+
+	fprintf ( stderr, "audio pool: %d MB, %d blocks of %d samples.\n", size, nb_blocks, POOL_BLOCK );
+	return 0;
+}
+
+
+/**************************************/
+/* functions for the realtime thread  */
+/**************************************/
+
+// get a free block from the pool; returns NULL if there is no more free block
+// this is O(1) and can be called from the realtime thread
+jack_default_audio_sample_t *pool_get () {
+
+	jack_default_audio_sample_t *block;
+
+	if (jack_ringbuffer_read (free_ring, (char *) &block, sizeof (block)) != sizeof (block)) {
+		if (!is_exhausted) logger_send (LOG_POOL_EXHAUSTED, 0, 0.0, NULL);
+		is_exhausted = TRUE;
+		return NULL;
+	}
+	is_exhausted = FALSE;
+
+	// ask pool thread to refill the ring of free blocks
+	sem_post (&pool_sem);
+	return block;
+}
+
+
+// give a block back to the pool; can be called from the realtime thread
+void pool_put (jack_default_audio_sample_t *block) {
+
+	jack_ringbuffer_write (release_ring, (char *) &block, sizeof (block));
+	sem_post (&pool_sem);
+}
+
+
+// returns a pointer to sample "index" of a track buffer, or NULL if there is no block for this sample (ie. silence)
+// *nframes is reduced to the number of samples that can be read or written from this pointer (ie. up to the end of the block)
+jack_default_audio_sample_t *pool_span (jack_default_audio_sample_t **buffer, jack_nframes_t index, jack_nframes_t *nframes) {
+
+	jack_nframes_t b = index >> POOL_BLOCK_SHIFT;
+	jack_nframes_t offset = index & POOL_BLOCK_MASK;
+
+	if (*nframes > POOL_BLOCK - offset) *nframes = POOL_BLOCK - offset;
+	if ((b >= NB_BLOCKS) || (buffer [b] == NULL)) return NULL;
+	return buffer [b] + offset;
+}
+
+
+// returns sample "index" of a track buffer
+jack_default_audio_sample_t pool_sample (jack_default_audio_sample_t **buffer, jack_nframes_t index) {
+
+	jack_nframes_t b = index >> POOL_BLOCK_SHIFT;
+
+	if ((b >= NB_BLOCKS) || (buffer [b] == NULL)) return 0.0f;
+	return buffer [b] [index & POOL_BLOCK_MASK];
+}
+
+
+// write nframes samples at "index" of a track buffer; blocks are taken from the pool when required
+// returns the number of samples written, which is less than nframes if the pool is exhausted
+jack_nframes_t pool_write (jack_default_audio_sample_t **buffer, jack_nframes_t index, jack_default_audio_sample_t *src, jack_nframes_t nframes) {
+
+	jack_nframes_t b, n;
+	jack_nframes_t written = 0;
+	jack_default_audio_sample_t *dst;
+
+	while (written < nframes) {
+		b = (index + written) >> POOL_BLOCK_SHIFT;
+		if (b >= NB_BLOCKS) break;
+		// new block required
+		if (buffer [b] == NULL) {
+			if ((buffer [b] = pool_get ()) == NULL) break;
+		}
+		n = nframes - written;
+		dst = pool_span (buffer, index + written, &n);
+		memcpy (dst, src + written, n * sizeof (jack_default_audio_sample_t));
+		written += n;
+	}
+
+	return written;
+}
+
+
+// set nframes samples at "index" of a track buffer to silence (blocks which are not used are already silence)
+void pool_clear (jack_default_audio_sample_t **buffer, jack_nframes_t index, jack_nframes_t nframes) {
+
+	jack_nframes_t n;
+	jack_default_audio_sample_t *dst;
+
+	while (nframes > 0) {
+		n = nframes;
+		dst = pool_span (buffer, index, &n);
+		if (dst != NULL) memset (dst, 0, n * sizeof (jack_default_audio_sample_t));
+		index += n;
+		nframes -= n;
+	}
+}
+
+
+// give all the blocks of a track buffer which are after "index" back to the pool (index = 0 means all the blocks)
+// blocks partly used by samples before "index" are kept; can be called from the realtime thread
+// while the pool is pinned, blocks are kept apart until it is unpinned: they may still be read by the save
+void pool_release (jack_default_audio_sample_t **buffer, jack_nframes_t index) {
+
+	jack_nframes_t b;
+
+	for (b = (index + POOL_BLOCK_MASK) >> POOL_BLOCK_SHIFT; b < NB_BLOCKS; b++) {
+		if (buffer [b] != NULL) {
+			if (is_pinned) deferred [deferred_count++] = buffer [b];
+			else pool_put (buffer [b]);
+			buffer [b] = NULL;
+		}
+	}
+}
+
+
+// pin (or unpin) the blocks of the tracks, while main thread saves them from a snapshot (see snapshot); called from the realtime thread
+// blocks released while pinned go back to the pool when it is unpinned (they cannot be more than the blocks of the pool)
+void pool_pin (int pin) {
+
+	is_pinned = pin;
+	if (pin) return;
+	while (deferred_count > 0) pool_put (deferred [--deferred_count]);
+}
+
+
+// returns TRUE if the blocks of the tracks are pinned; called from the realtime thread
+int pool_pinned () {
+
+	return is_pinned;
+}
+
+
+/******************************************/
+/* functions for the non realtime threads */
+/******************************************/
+
+// create an empty track buffer, ie. a table of NB_BLOCKS blocks
+// table is locked in memory, as it is written by the realtime thread
+jack_default_audio_sample_t **pool_buffer () {
+
+	jack_default_audio_sample_t **buffer;
+
+	if ((buffer = calloc (NB_BLOCKS, sizeof (jack_default_audio_sample_t *))) == NULL) {
+		fprintf ( stderr, "error in creating track buffer.\n" );
+		exit ( 1 );
+	}
+	mlock (buffer, NB_BLOCKS * sizeof (jack_default_audio_sample_t *));
+	return buffer;
+}
+
+
+// get a free block from the reserve; returns NULL if there is no more free block
+jack_default_audio_sample_t *pool_alloc () {
+
+	jack_default_audio_sample_t *block = NULL;
+
+	pthread_mutex_lock (&reserve_mutex);
+	if (reserve_count > 0) block = reserve [--reserve_count];
+	pthread_mutex_unlock (&reserve_mutex);
+
+	return block;
+}
+
+
+// give a block back to the reserve
+void pool_free (jack_default_audio_sample_t *block) {
+
+	memset (block, 0, POOL_BLOCK * sizeof (jack_default_audio_sample_t));
+	pthread_mutex_lock (&reserve_mutex);
+	reserve [reserve_count++] = block;
+	pthread_mutex_unlock (&reserve_mutex);
+	sem_post (&pool_sem);
+}
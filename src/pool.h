@@ -0,0 +1,19 @@
+/** @file pool.h
+ *
+ * @brief This file defines prototypes of functions inside pool.c
+ *
+ */
+
+int pool_init (int);
+jack_default_audio_sample_t *pool_get ();
+void pool_put (jack_default_audio_sample_t *);
+jack_default_audio_sample_t *pool_span (jack_default_audio_sample_t **, jack_nframes_t, jack_nframes_t *);
+jack_default_audio_sample_t pool_sample (jack_default_audio_sample_t **, jack_nframes_t);
+jack_nframes_t pool_write (jack_default_audio_sample_t **, jack_nframes_t, jack_default_audio_sample_t *, jack_nframes_t);
+void pool_clear (jack_default_audio_sample_t **, jack_nframes_t, jack_nframes_t);
+void pool_release (jack_default_audio_sample_t **, jack_nframes_t);
+void pool_pin (int);
+int pool_pinned ();
+jack_default_audio_sample_t **pool_buffer ();
+jack_default_audio_sample_t *pool_alloc ();
+void pool_free (jack_default_audio_sample_t *);
@@ -13,428 +13,473 @@
 #include "time.h"
 #include "utils.h"
 #include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
 
 
 
+// get next event of a midi port: *index is the index of the event in the port, and is incremented
+// returns 0 if there is no more event in the port
+static int next_event (void *port, jack_nframes_t *index, jack_nframes_t count, jack_midi_event_t *event, const char *name) {
+
+	while (*index < count) {
+		if (jack_midi_event_get (event, port, (*index)++) == 0) return 1;
+		logger_send (LOG_MISSED_EVENT, 0, 0.0, name);
+	}
+
+	return 0;
+}
+
+
+// process audio of the tracks for nframes frames, from frame "offset" of the cycle
+// the cycle is split in several parts at the time of the midi events, so these take effect on the exact frame
+static void process_audio (jack_default_audio_sample_t *in_left, jack_default_audio_sample_t *in_right, jack_default_audio_sample_t *out_left, jack_default_audio_sample_t *out_right, jack_nframes_t offset, jack_nframes_t nframes) {
+
+	int j;
+	int last;								// last track to be mixed during this part of the cycle
+	unsigned int audible, playing, recording, active, mixed;	// masks of tracks (bit j is track j)
+
+	in_left += offset;
+	in_right += offset;
+	out_left += offset;
+	out_right += offset;
+
+	// mute and solo status are computed for each part of the cycle: this gives the tracks that can be heard
+	audible = audible_tracks ();
+	playing = playing_tracks ();
+	recording = recording_tracks ();
+	// after midi stop, tracks neither play nor record (audio in still goes to audio out)
+	if (is_paused) playing = recording = 0;
+	// tracks which are neither playing nor recording are skipped
+	active = playing | recording;
+	// last track to be mixed: clipping of audio out will be done while mixing this track
+	mixed = playing & audible;
+	last = (mixed) ? (31 - __builtin_clz (mixed)) : -1;
+	stats_tracks (__builtin_popcount (active));
+
+	/* process each active track */
+	while (active) {
+		// get lowest active track, and remove it from the mask
+		j = __builtin_ctz (active);
+		active &= active - 1;
+
+		// NOTE: we process PLAY events before RECORD to allow playing and recording at the same time
+		// this allows to play the internal track buffer before potentially overwriting it with new data
+		// (although the result is not so great ;-) )
+
+		/*******************/
+		/* PLAY processing */
+		/*******************/
+		if ((playing >> j) & 1) {
+			stats_begin (STAGE_PLAY);
+			mix_track (j, out_left, out_right, nframes, (audible >> j) & 1, (j == last));
+			stats_end (STAGE_PLAY);
+		}
+
+		/*********************/
+		/* RECORD processing */
+		/*********************/
+		if ((recording >> j) & 1) {
+			stats_begin (STAGE_RECORD);
+			record_track (j, in_left, in_right, nframes);
+			stats_end (STAGE_RECORD);
+		}
+	}
+
+	// check if out audio buffer is not out of boundaries {-1.0, +1.0} to limit saturation
+	// if a track has been mixed, this has already been done by the mix kernels
+	if (last < 0) {
+		stats_begin (STAGE_CLIP);
+		mix_clip (out_left, nframes);
+		mix_clip (out_right, nframes);
+		stats_end (STAGE_CLIP);
+	}
+}
+
+
+// song position has changed (midi play, song position pointer): playing tracks in bar mode are moved to the position of their loop
+// which matches the new bar and tick (loops keep their bar phase); recording tracks keep the number of bars recorded so far
+// previous_bar is the bar before the clock event which has moved the song position
+static void seek_tracks (unsigned int previous_bar) {
+
+	int i;
+	long long bars, loop_bars, delta;
+	double bar_ticks, ticks;
+	unsigned int playing, recording;
+	track_t *t;
+
+	// length of a bar, in ticks; bar of the clock event if song position had not changed
+	bar_ticks = ((double) ppbar * BBT_numerator) / BBT_denominator;
+	delta = (long long) BBT_bar - previous_bar - ((is_BBT == ON) ? 1 : 0);
+
+	playing = playing_tracks ();
+	recording = recording_tracks ();
+
+	for (i = 0; i < nb_tracks; i++) {
+		t = &track[i];
+
+		if ((recording >> i) & 1) {
+			t->record_bar_left += delta;
+			t->record_bar_right += delta;
+			continue;
+		}
+
+		// only loops of bar mode are moved: loops of free mode loop by themselves
+		loop_bars = (long long) t->end_bar_left - t->record_bar_left;
+		if (!((playing >> i) & 1) || (t->status[MODE] != OFF) || (loop_bars <= 0) || (t->end_index_left == 0)) continue;
+
+		// bar of the loop, and position in the loop (ticks since the start of the loop): this is a direct computation, whatever the move
+		bars = ((long long) BBT_bar - t->play_bar_left) % loop_bars;
+		if (bars < 0) bars += loop_bars;
+		t->play_bar_left = BBT_bar - bars;
+		t->play_bar_right = BBT_bar - bars;
+		ticks = (bars * bar_ticks) + (BBT_tick - 1);
+		t->play_index_left = (jack_nframes_t) floor ((ticks * t->end_index_left) / (loop_bars * bar_ticks));
+		t->play_index_right = (jack_nframes_t) floor ((ticks * t->end_index_right) / (loop_bars * bar_ticks));
+		if (t->play_index_left >= t->end_index_left) t->play_index_left = 0;
+		if (t->play_index_right >= t->end_index_right) t->play_index_right = 0;
+		t->play_frac_left = 0.0;
+		t->play_frac_right = 0.0;
+	}
+}
+
+
 // main process callback called at capture of (nframes) frames/samples
 int process ( jack_nframes_t nframes, void *arg )
 {
-	jack_nframes_t h;
-	int i,j,k;
-	int mute = OFF;
 	void *midiin;
-	void *clockin;
 	void *midiout;
-	jack_nframes_t nframes_half;			// anti-crack variables
-	jack_default_audio_sample_t sample;		// anti-crack variables
-	jack_default_audio_sample_t *in, *out;
-//	jack_midi_event_t *clock_event, *in_event;
+	jack_default_audio_sample_t *in_left, *in_right, *out_left, *out_right;
 	jack_midi_event_t clock_event, in_event;
-	jack_midi_data_t buffer[5];				// midi out buffer for lighting the pad leds
-	int dest, tracknum, type, on_off;		// variables used to manage lighting of the pad leds
+	jack_nframes_t in_index, in_count;
+	jack_nframes_t offset, time;			// current frame of the cycle, and frame of next event
+	int is_in, is_clock;					// TRUE if there is a pending event on the port
 
 
-	/***********************************************/
-	/* set recording and playing values by default */
-	/* these values may be altered by incoming     */
-	/* MIDI in events which are processed after    */
-	/* this is why it is important to put this     */
-	/* init here, so init values can be overwritten*/
-	/* later on in the processing                  */
-	/***********************************************/
+	/****************************************************/
+	/* First, complete the commands done by main thread */
+	/****************************************************/
 
-	// used later for audio-crack removal
-//	nframes_half = nframes / 16;
-	nframes_half = 8;
+	stats_cycle_begin ();
+	stats_begin (STAGE_COMMAND);
+	command_process ();
+	stats_end (STAGE_COMMAND);
 
+	// playback rates of the tracks follow the tempo of the clock (resampling)
+	resample_update ();
 
-	/****************************************/
-	/* First, process MIDI and CLOCK events */
-	/****************************************/
 
-	// allocate structure that will receive MIDI events
-	//clock_event = calloc (1, sizeof (jack_midi_event_t));
-	//in_event = calloc (1, sizeof (jack_midi_event_t));
+	/*****************************************************/
+	/* Then, process MIDI and CLOCK events, and AUDIO    */
+	/*****************************************************/
 
-	// Get midi clock midi out and midi in buffers
-	clockin = jack_port_get_buffer(clock_input_port, nframes);
-	midiin = jack_port_get_buffer(midi_input_port, nframes);
+	// now process audio events: as this "process" function has been called, it means that the audio buffer is full
+	// 2 inputs ports : sound card has 2 mono inputs (also could be considered as Left, Right)
+	in_left = jack_port_get_buffer ( input_ports[0], nframes );
+	in_right = jack_port_get_buffer ( input_ports[1], nframes );
+	out_left = jack_port_get_buffer ( output_ports[0], nframes );
+	out_right = jack_port_get_buffer ( output_ports[1], nframes );
 
-	// process MIDI IN events
-	for (i=0; i< jack_midi_get_event_count(midiin); i++) {
-		if (jack_midi_event_get (&in_event, midiin, i) != 0) {
-			fprintf ( stderr, "Missed in event\n" );
-			continue;
-		}
-		// call processing function
-		midi_in_process (&in_event,nframes);
-	}
+	/* in any case, copy audio in to audio out */
+	memcpy ( out_left, in_left, nframes * sizeof ( jack_default_audio_sample_t ) );
+	memcpy ( out_right, in_right, nframes * sizeof ( jack_default_audio_sample_t ) );
 
-	// process MIDI CLOCK events
-	for (i=0; i< jack_midi_get_event_count(clockin); i++) {
-		if (jack_midi_event_get (&clock_event, clockin, i) != 0) {
-			fprintf ( stderr, "Missed clock event\n" );
-			continue;
+	// Get midi in buffer, and clock events of the cycle from the clock source (midi clock port or JACK transport)
+	stats_begin (STAGE_MIDI);
+	midiin = jack_port_get_buffer(midi_input_port, nframes);
+	in_index = 0;
+	in_count = jack_midi_get_event_count (midiin);
+	is_in = next_event (midiin, &in_index, in_count, &in_event, "in");
+	clock_start (nframes);
+	is_clock = clock_next (&clock_event);
+	stats_end (STAGE_MIDI);
+
+	// process MIDI IN and MIDI CLOCK events in time order; audio is processed up to the time of each event, so the event takes effect on its exact frame
+	// MIDI IN events go first when at the same time: a pad pressed right before a tick is taken into account at this tick
+	offset = 0;
+	while (is_in || is_clock) {
+		time = (is_in && (!is_clock || (in_event.time <= clock_event.time))) ? in_event.time : clock_event.time;
+		if (time > nframes) time = nframes;
+		if (time > offset) {
+			process_audio (in_left, in_right, out_left, out_right, offset, time - offset);
+			offset = time;
 		}
+
 		// call processing function
-		midi_clock_process (&clock_event,nframes);
+		stats_begin (STAGE_MIDI);
+		if (is_in && (!is_clock || (in_event.time <= clock_event.time))) {
+			midi_in_process (&in_event, nframes);
+			is_in = next_event (midiin, &in_index, in_count, &in_event, "in");
+		}
+		else {
+			midi_clock_process (&clock_event, nframes);
+			is_clock = clock_next (&clock_event);
+		}
+		stats_end (STAGE_MIDI);
 	}
 
+	// process audio up to the end of the cycle
+	if (offset < nframes) process_audio (in_left, in_right, out_left, out_right, offset, nframes - offset);
+
 
 	/****************************************/
 	/* Second, process MIDI out (UI) events */
 	/****************************************/
 
 	// define midi out port to write to
+	stats_begin (STAGE_LED);
 	midiout = jack_port_get_buffer (midi_output_port, nframes);
 
-	i = 0;
-
 	// clear midi write buffer
 	jack_midi_clear_buffer (midiout);
 
-	//go through the list of led requests
-	while (pull_from_list(&dest, &tracknum, &type, &on_off)) {
-
-		// if this is a track led
-		// copy midi event required to light led into midi buffer
-		if (dest == TRACK) memcpy (buffer, &track[tracknum].led [type][on_off][0], 3);
-		// copy midi event required to light led into midi buffer
-		if (dest == BAR) memcpy (buffer, &bar[tracknum].led [type][on_off][0], 3);
-
-		// if buffer is not empty, then send as midi out event
-		// we take care of writing led events at different time marks to make sure all of these are taken into account
-		if (buffer [0] | buffer [1] | buffer [2]) {
-			jack_midi_event_write (midiout, 0, buffer, 3);
-//			jack_midi_event_write (midiout, i++, buffer, 3);
-// UNCOMMENT THE BELOW LINE FOR MIDI OUT TRACING
-// 0x50 is the "clock" led
-//if (buffer[1]!=0x50) printf ("%02x %02x %02x\n", buffer[0], buffer[1], buffer[2]);
-		}
-	}
+	// send the led requests
+	led_send (midiout, nframes);
+	stats_end (STAGE_LED);
 
+	// summaries of the messages which have not been logged
+	logger_flush ();
 
+	// publish the times of the stages of this cycle
+	stats_cycle_end ();
 
-	/*******************************/
-	/* Third, process AUDIO events */
-	/*******************************/
+	return 0;
+}
 
-	// now process audio events: as this "process" function has been called, it means that the audio buffer is full
-	// 2 inputs ports : sound card has 2 mono inputs (also could be considered as Left, Right)
-	for (i = 0; i < 2; i++)
-	{
-		in = jack_port_get_buffer ( input_ports[i], nframes );
-		out = jack_port_get_buffer ( output_ports[i], nframes );
-
-		/* in any case, copy audio in to audio out */
-		memcpy ( out, in, nframes * sizeof ( jack_default_audio_sample_t ) );
-
-		/* process each track */
-		for (j=0; j<NB_TRACKS; j++) {
-			// NOTE: we process PLAY events before RECORD to allow playing and recording at the same time
-			// this allows to play the internal track buffer before potentially overwriting it with new data
-			// (although the result is not so great ;-) )
-
-			/*******************/
-			/* PLAY processing */
-			/*******************/
-
-			// test if play is on or pending_off (ie. still on)
-			if ((track[j].status[PLAY] == ON) || (track[j].status[PLAY] == PENDING_OFF)) {
-
-				mute = OFF;
-				// determine if track shoud be muted, either because it has mute button, or because one of the tracks is in solo
-				if (track[j].status[MUTE] == ON) mute = ON;
-				// check if another track is in solo mode
-				for (k=0; k< NB_TRACKS; k++) {
-				// check status of the other tracks; if one of the other tracks is SOLO, then mute current track
-					if ((k != j) && (track[k].status[SOLO] == ON)) mute = ON;
-				}
 
-				if (i == 0) {
-					// left channel
-					// check if we are in BBT mode, and we have a new bar
-					// check if length played in bar is equal to length in bar of what has been recorded; if this is the case, then loop
-					if (is_pending_action (j) == ON_BBT) {
-						if ((BBT_bar - track[j].play_bar_left) >= (track[j].end_bar_left - track[j].record_bar_left)) {
-							track[j].play_index_left = 0;
-							track[j].play_bar_left = BBT_bar;
-						}
-					}
+// functions of the control surface: one function for each action, called from the dispatch table of the controls
+// i is the track number (track 1 for the global functions: time signature, load, save, tap)
 
-					for (k = 0 ; k <nframes; k++) {
-						// audio crack removal mechanism
-						// this is basically making sure that the end of recording (last sample) corresponds to the start of recording (first sample).
-						// so when we play the start of recording, we allocate "nframes_half" samples to make a linear progression between last sample value and first sample value
-
-						// audio sample to be send to audio out
-						sample = track [j].left [(track[j].play_index_left + k)];
-
-						// check if we are at the beginning of the sample, ie: new loop
-						if (track[j].play_index_left == 0) {
-							// we are at the beginning of the new loop: we need to make the link with previous sample played to avoid cracking noises
-							// to do this, we will do a linear progression from the last sample (played in the last callback call) to the middle of the frame set
-							if (k <= nframes_half) {
-								sample = track[j].last_sample_left + ((track [j].left [(track[j].play_index_left + nframes_half)] - track[j].last_sample_left) * (jack_default_audio_sample_t)((float) k / (float) nframes_half));
-							}
-						}
+// time signature pad: set new time signature and force new bar
+static void action_timesign (int i, jack_midi_event_t *event) {
 
-						// copy only if track is not muted
-						if (mute == OFF) out [k] += sample * track[j].volume;
-					}
+	change_timesign ();
+	// no need to switch any pad led on: as we are forcing new bar, next clock event will be a new bar, which will lit the timesign pad on
+}
 
-					// set new value for last sample : sample contains the last sample to be played
-					track[j].last_sample_left = sample;
 
-					// increment index and check if not overflow or not over end of the recording
-					track[j].play_index_left += nframes;
-					if ((track[j].play_index_left >= NB_SAMPLES) || (track[j].play_index_left >= track[j].end_index_left)) track[j].play_index_left = 0;
-				}
+// tap pad: tempo of the internal clock is given by the last taps
+static void action_tap (int i, jack_midi_event_t *event) {
 
-				if (i == 1) {
-					// right channel
-					// check if we are in BBT mode, and we have a new bar
-					// check if length played in bar is equal to length in bar of what has been recorded; if this is the case, then loop
-					if (is_pending_action (j) == ON_BBT) {
-						if ((BBT_bar - track[j].play_bar_right) >= (track[j].end_bar_right - track[j].record_bar_right)) {
-							track[j].play_index_right = 0;
-							track[j].play_bar_right = BBT_bar;
-						}
-					}
+	clock_tap (jack_last_frame_time (client) + event->time);
+}
 
-					for (k = 0 ; k <nframes; k++) {
-						// audio crack removal mechanism
-						// this is basically making sure that the end of recording (last sample) corresponds to the start of recording (first sample).
-						// so when we play the start of recording, we allocate "nframes_half" samples to make a linear progression between last sample value and first sample value
-
-						// audio sample to be send to audio out
-						sample = track [j].right [(track[j].play_index_right + k)];
-
-						// check if we are at the beginning of the sample, ie: new loop
-						if (track[j].play_index_right == 0) {
-							// we are at the beginning of the new loop: we need to make the link with previous sample played to avoid cracking noises
-							// to do this, we will do a linear progression from the last sample (played in the last callback call) to the middle of the frame set
-							if (k <= nframes_half) {
-								sample = track[j].last_sample_right + ((track [j].right [(track[j].play_index_right + nframes_half)] - track[j].last_sample_right) * (jack_default_audio_sample_t)((float) k / (float) nframes_half));
-							}
-						}
 
-						// copy only if track is not muted
-						if (mute == OFF) out [k] += sample * track[j].volume;
-					}
+// load pad: ask main thread to load, unless a previous load is not complete yet; load led on
+static void action_load (int i, jack_midi_event_t *event) {
 
-					// set new value for last sample : sample contains the last sample to be played
-					track[j].last_sample_right = sample;
+	if ((is_swap == OFF) && command_send (CMD_LOAD, 0)) led (0, LOAD, ON);
+}
 
-					// increment index and check if not overflow or not over end of the recording
-					track[j].play_index_right += nframes;
-					if ((track[j].play_index_right >= NB_SAMPLES) || (track[j].play_index_right >= track[j].end_index_right)) track[j].play_index_right = 0;
-				}
-			}
 
+// save pad: ask main thread to save; save led on
+static void action_save (int i, jack_midi_event_t *event) {
 
-			/*********************/
-			/* RECORD processing */
-			/*********************/
-			// test if record is on or pending_off (ie. still on)
-			if ((track[j].status[RECORD] == ON) || (track[j].status[RECORD] == PENDING_OFF)) {
+	// a save is already running
+	if (pool_pinned ()) return;
 
-				if (i == 0) {
-					// left channel
-					// copy input to record buffer
-					memcpy ((track[j].left + track[j].record_index_left), in, nframes * sizeof ( jack_default_audio_sample_t ));
-					// increment index and check if not overflow
-					track[j].record_index_left = (track[j].record_index_left >= NB_SAMPLES) ? 0 : (track[j].record_index_left + nframes);
-				}
+	// main thread saves a snapshot of the tracks, whose blocks are kept until the save is done: snapshot is taken before main thread gets the command
+	snapshot ();
+	if (command_send (CMD_SAVE, 0)) led (0, SAVE, ON);
+	else pool_pin (FALSE);
+}
 
-				if (i == 1) {
-					// right channel
-					// copy input to record buffer
-					memcpy ((track[j].right + track[j].record_index_right), in, nframes * sizeof ( jack_default_audio_sample_t ));
-					// increment index and check if not overflow
-					track[j].record_index_right = (track[j].record_index_right >= NB_SAMPLES) ? 0 : (track[j].record_index_right + nframes);
-				}
-			}
-		}
 
+// PLAY
+static void action_play (int i, jack_midi_event_t *event) {
 
-		// check if out audio buffer is not out of boundaries {-1.0, +1.0} to limit saturation
-		for (h=0; h<nframes; h++) {
-			if (out [h] > 1.0f) out [h] = 1.0f;
-			if (out [h] < -1.0f) out [h] = -1.0f;
-		}
+	// check whether there is any recording to play; if not, then PLAY shall be OFF
+	if ((track[i].end_index_left == 0) && (track[i].end_index_right == 0)) track[i].status[PLAY] = OFF;
+	else {
+		// play event: set status accordingly
+		track[i].status[PLAY] = next_status_4 (track[i].status[PLAY]);
 	}
+	// switch led on according to status
+	led (i, PLAY, track[i].status[PLAY]);
+}
 
-	return 0;
+
+// RECORD
+static void action_record (int i, jack_midi_event_t *event) {
+
+	// record event: set status accordingly
+	track[i].status[RECORD] = next_status_4 (track[i].status[RECORD]);
+	// switch led on according to status
+	led (i, RECORD, track[i].status[RECORD]);
 }
 
 
-// process callback called to process midi_in events in realtime
-int midi_in_process (jack_midi_event_t *event, jack_nframes_t nframes) {
+// MUTE
+static void action_mute (int i, jack_midi_event_t *event) {
 
-	int i, j;
-	int k,l;
+	// mute event: set status accordingly
+	track[i].status[MUTE] = next_status_2 (track[i].status[MUTE]);
+	// switch led on according to status
+	led (i, MUTE, track[i].status[MUTE]);
+}
 
-	// check change in time signature by checking if pad has been pressed; if yes, set new time signature and force new bar
-	if (same_event(event->buffer,track[0].ctrl[TIMESIGN])) {
-		change_timesign ();
-		// no need to switch any pad led on: as we are forcing new bar, next clock event will be a new bar, which will lit the timesign pad on
-	}
 
-	// check if load pad has been pressed
-	if (same_event(event->buffer,track[0].ctrl[LOAD])) {
-		is_load=TRUE;
-		// load led on
-		led (0, LOAD, ON);
-	}
+// SOLO
+static void action_solo (int i, jack_midi_event_t *event) {
 
-	// check if save pad has been pressed
-	if (same_event(event->buffer,track[0].ctrl[SAVE])) {
-		is_save=TRUE;
-		// save led on
-		led (0, SAVE, ON);
-	}
+	int j;
 
-	// check all the tracks to see if MIDI in event (ie. UI event) corresponds to one of the track
-	// event->buffer contains the midi buffer
-	for (i=0; i< NB_TRACKS; i++) {
-
-		// check MIDI code of midi in event with track functions
-		// PLAY
-		if (same_event(event->buffer,track[i].ctrl[PLAY])) {
-			// check whether there is any recording to play; if not, then PLAY shall be OFF
-			if ((track[i].end_index_left == 0) && (track[i].end_index_right == 0)) track[i].status[PLAY] = OFF;
-			else {
-				// play event: set status accordingly
-				track[i].status[PLAY] = next_status_4 (track[i].status[PLAY]);
+	// solo event: set status accordingly
+	track[i].status[SOLO] = next_status_2 (track[i].status[SOLO]);
+	// switch led on according to status
+	led (i, SOLO, track[i].status[SOLO]);
+
+	// if solo event is set ON, remove solo from the other tracks
+	if (track[i].status[SOLO] == ON) {
+		for (j=0; j< nb_tracks; j++) {
+			if (j != i) {
+				track[j].status[SOLO] = OFF;
+				// switch led on according to status
+				led (j, SOLO, track[j].status[SOLO]);
 			}
-			// switch led on according to status
-			led (i, PLAY, track[i].status[PLAY]);
 		}
+	}
+}
 
-		// RECORD
-		if (same_event(event->buffer,track[i].ctrl[RECORD])) {
-			// record event: set status accordingly
-			track[i].status[RECORD] = next_status_4 (track[i].status[RECORD]);
-			// switch led on according to status
-			led (i, RECORD, track[i].status[RECORD]);
-		}
 
-		// MUTE
-		if (same_event(event->buffer,track[i].ctrl[MUTE])) {
-			// mute event: set status accordingly
-			track[i].status[MUTE] = next_status_2 (track[i].status[MUTE]);
-			// switch led on according to status
-			led (i, MUTE, track[i].status[MUTE]);
-		}
+// VOLDOWN
+static void action_voldown (int i, jack_midi_event_t *event) {
 
-		// SOLO
-		if (same_event(event->buffer,track[i].ctrl[SOLO])) {
-			// solo event: set status accordingly
-			track[i].status[SOLO] = next_status_2 (track[i].status[SOLO]);
-			// switch led on according to status
-			led (i, SOLO, track[i].status[SOLO]);
-
-			// if solo event is set ON, remove solo from the other tracks
-			if (track[i].status[SOLO] == ON) {
-				for (j=0; j< NB_TRACKS; j++) {
-					if (j != i) {
-						track[j].status[SOLO] = OFF;
-						// switch led on according to status
-						led (j, SOLO, track[j].status[SOLO]);
-					}
-				}
-			}
-		}
+	// volume down event: volume does not have a real "status"
+	// switch led on according to status
+	led (i, VOLDOWN, PENDING_ON);
+	led (i, VOLUP, OFF);
 
-		// VOLDOWN
-		if (same_event(event->buffer,track[i].ctrl[VOLDOWN])) {
-			// volume down event: volume does not have a real "status"
-			// switch led on according to status
-			led (i, VOLDOWN, PENDING_ON);
-			led (i, VOLUP, OFF);
-
-			// this is an decrement of 0.1
-			if (track [i].volume > 0.1f) {
-				track [i].volume -=0.1f;   // decrement of 0.1
-				// switch led off according to status
-				led (i, VOLDOWN, OFF);
-			}
-			else {
-				track [i].volume = 0.0f;                            // line is useless, we keep it to be safe
-				// in case we are at min volume, we keep the pad lit (on)
-				led (i, VOLDOWN, ON);
-			}
-		}
+	// this is an decrement of 0.1
+	if (track [i].volume > 0.1f) {
+		track [i].volume -=0.1f;   // decrement of 0.1
+		// switch led off according to status
+		led (i, VOLDOWN, OFF);
+	}
+	else {
+		track [i].volume = 0.0f;                            // line is useless, we keep it to be safe
+		// in case we are at min volume, we keep the pad lit (on)
+		led (i, VOLDOWN, ON);
+	}
+}
 
-		// VOLUP
-		if (same_event(event->buffer,track[i].ctrl[VOLUP])) {
-			// volume up event: volume does not have a real "status"
-			// switch led on according to status
-			led (i, VOLUP, PENDING_ON);
-			led (i, VOLDOWN, OFF);
-
-			// this is an increment of 0.1
-			if (track [i].volume < 0.9f) {
-				track [i].volume +=0.1f;   // increment of 0.1
-				// switch led off according to status
-				led (i, VOLUP, OFF);
-			}
-			else {
-				track [i].volume = 1.0f;                            // line is useless, we keep it to be safe
-				// in case we are at max volume, we keep the pad lit (on)
-				led (i, VOLUP, ON);
-			}
-		}
 
-		// MODE
-		if (same_event(event->buffer,track[i].ctrl[MODE])) {
-			// mute event: set status accordingly
-			track[i].status[MODE] = next_status_2 (track[i].status[MODE]);
-			// switch led on according to status
-			led (i, MODE, track[i].status[MODE]);
-		}
+// VOLUP
+static void action_volup (int i, jack_midi_event_t *event) {
 
-		// DELETE
-		if (same_event(event->buffer,track[i].ctrl[DELETE])) {
-			// delete event: set status accordingly
-			track[i].status[DELETE] = next_status_4 (track[i].status[DELETE]);
-			// switch led on according to status
-			led (i, DELETE, track[i].status[DELETE]);
-		}
+	// volume up event: volume does not have a real "status"
+	// switch led on according to status
+	led (i, VOLUP, PENDING_ON);
+	led (i, VOLDOWN, OFF);
+
+	// this is an increment of 0.1
+	if (track [i].volume < 0.9f) {
+		track [i].volume +=0.1f;   // increment of 0.1
+		// switch led off according to status
+		led (i, VOLUP, OFF);
+	}
+	else {
+		track [i].volume = 1.0f;                            // line is useless, we keep it to be safe
+		// in case we are at max volume, we keep the pad lit (on)
+		led (i, VOLUP, ON);
 	}
+}
 
-	// check all the bars to see if MIDI in event (ie. UI event) corresponds to one of the bar rows
-	// event->buffer contains the midi buffer
-	for (i=0; i< NB_BAR_ROWS; i++) {
 
-		// check MIDI code of midi in event with track functions
-		for (j=0; j<LAST_BAR_ELT; j++) {
-			if (same_event(event->buffer,bar[i].ctrl[j])) {
+// MODE
+static void action_mode (int i, jack_midi_event_t *event) {
 
-				// we pressed one pad in the bar row; change its value to ON or OFF based on its previous status
-				bar[i].status[j] = next_status_2 (bar[i].status[j]);
+	// mute event: set status accordingly
+	track[i].status[MODE] = next_status_2 (track[i].status[MODE]);
+	// switch led on according to status
+	led (i, MODE, track[i].status[MODE]);
+}
 
-				// make sure no other bar led is ON, except the one we have pressed
-				for (k=0; k< NB_BAR_ROWS; k++) {
-					for (l=0; l< LAST_BAR_ELT; l++) {
-						if ((k!=i) || (l!=j)) {
-							// force the other bar leds to OFF
-							bar[k].status[l] = OFF;
-							bar_led (k, l, OFF);
-						}
-					}
-				}
 
-				// calculate new value of number_of_bars, depending on pad that has been pressed
-				if (bar[i].status[j] == ON)
-					number_of_bars = ((i * LAST_BAR_ELT) + j + 1);
-				else number_of_bars = 0;
-				// switch led on according to status
-				bar_led (i, j, bar[i].status[j]);
+// DELETE
+static void action_delete (int i, jack_midi_event_t *event) {
+
+	// delete event: set status accordingly
+	track[i].status[DELETE] = next_status_4 (track[i].status[DELETE]);
+	// switch led on according to status
+	led (i, DELETE, track[i].status[DELETE]);
+}
+
+
+// STRETCH
+static void action_stretch (int i, jack_midi_event_t *event) {
+
+	// ask main thread to stretch the track to the current tempo; stretch led shows the progress, then stays on until the stretched track is swapped at next bar
+	stretch_request (i);
+}
+
+
+// pad j of bar row i: number of bars to be recorded
+static void action_bar (int i, int j) {
+
+	int k,l;
+
+	// we pressed one pad in the bar row; change its value to ON or OFF based on its previous status
+	bar[i].status[j] = next_status_2 (bar[i].status[j]);
+
+	// make sure no other bar led is ON, except the one we have pressed
+	for (k=0; k< NB_BAR_ROWS; k++) {
+		for (l=0; l< LAST_BAR_ELT; l++) {
+			if ((k!=i) || (l!=j)) {
+				// force the other bar leds to OFF
+				bar[k].status[l] = OFF;
+				bar_led (k, l, OFF);
 			}
 		}
 	}
+
+	// calculate new value of number_of_bars, depending on pad that has been pressed
+	if (bar[i].status[j] == ON)
+		number_of_bars = ((i * LAST_BAR_ELT) + j + 1);
+	else number_of_bars = 0;
+	// switch led on according to status
+	bar_led (i, j, bar[i].status[j]);
+}
+
+
+// function of each track element (see types.h)
+static void (*track_actions [LAST_ELT]) (int, jack_midi_event_t *) = {
+	[TIMESIGN] = action_timesign,
+	[LOAD] = action_load,
+	[SAVE] = action_save,
+	[PLAY] = action_play,
+	[RECORD] = action_record,
+	[MUTE] = action_mute,
+	[SOLO] = action_solo,
+	[VOLDOWN] = action_voldown,
+	[VOLUP] = action_volup,
+	[MODE] = action_mode,
+	[DELETE] = action_delete,
+	[STRETCH] = action_stretch,
+	[TAP] = action_tap
+};
+
+
+// process callback called to process midi_in events in realtime
+// the action of the midi event (status, data 1) is given by the dispatch table of the controls, built from config file
+int midi_in_process (jack_midi_event_t *event, jack_nframes_t nframes) {
+
+	control_t *control;
+
+	if (event->size < 2) return 0;
+	control = find_control (event->buffer);
+
+	if (control->type == CTRL_TRACK) track_actions [control->elt] (control->num, event);
+	else if (control->type == CTRL_BAR) action_bar (control->num, control->elt);
+
+	return 0;
 }
 
 
@@ -442,6 +487,9 @@ int midi_in_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 int midi_clock_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 
 	int i;
+	int on_off;								// led of the time signature pad (and tap pad)
+	unsigned int previous_bar;				// bar before the clock event (to move the tracks when song position changes)
+	jack_nframes_t length;					// exact length of a loop recorded in bar mode
 	// matriboxstop is the same string, but last 0x01 of the string is replaced with 0x00
 	unsigned char matribox_play [28] = {0x21, 0x25, 0x7e, 0x47, 0x50, 0x2d, 0x32, 0x12, 0x08, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00};
 
@@ -455,16 +503,57 @@ int midi_clock_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 	}
 
 	// in case of midi play event, then next CLOCK event is a new bar
+	// this is the start of the song: playing tracks are moved to the start of the bar of their loop, and play again if these were paused
 	if (event->buffer[0] == MIDI_PLAY) {
 		is_BBT = PENDING_ON;		// indicates we have a new bar
+		is_seek = ON;
+		is_paused = FALSE;
+	}
+
+	// in case of midi stop event, tracks are paused, and clock events are ignored (some devices keep on sending clock events when stopped)
+	if (event->buffer[0] == MIDI_STOP) {
+		is_paused = TRUE;
+	}
+
+	// in case of midi continue event, tracks play again from where these were paused (or from the song position pointer)
+	if (event->buffer[0] == MIDI_CONTINUE) {
+		is_paused = FALSE;
+	}
+
+	// in case of song position pointer event (position in 1/16 notes), next CLOCK event is at this position of the song
+	if ((event->buffer[0] == MIDI_SPP) && (event->size >= 3)) {
+		time_seek (((((event->buffer[2] & 0x7F) << 7) | (event->buffer[1] & 0x7F)) * ppbar) / 16);
+		is_seek = ON;
 	}
 
 	// in case of midi clock event
 	if (event->buffer[0] == MIDI_CLOCK) {
 
+		// feed tempo estimator with the absolute frame time of the tick
+		tempo_tick (&tempo, clock_tick_frame ());
+
+		// clock is stopped
+		if (is_paused) return 0;
+
 		// calculate new BBT (bar, beat, tick) as we had clock event
-		// and switch leds
-		led (0, TIMESIGN, time_progress ());
+		// and switch leds: tap pad blinks with the beats, like time signature pad
+		previous_bar = BBT_bar;
+		on_off = time_progress ();
+		led (0, TIMESIGN, on_off);
+		led (0, TAP, on_off);
+
+		// song position has changed: playing tracks are moved to the new position
+		if (is_seek == ON) {
+			seek_tracks (previous_bar);
+			is_seek = OFF;
+		}
+
+		// if a session has been loaded, swap it with the tracks now that we have a new bar
+		if ((is_BBT == ON) && (is_swap == PENDING_ON)) swap ();
+
+		// same for a stretched track; otherwise show the progress of the stretch
+		if (is_BBT == ON) stretch_swap ();
+		stretch_progress ();
 
 		// process the UI, ie. through MIDI IN events
 		// there are 2 possibilities for each track : either mode == OFF, in which case we are in BBT mode, ie. events only occur at bar change
@@ -475,7 +564,7 @@ int midi_clock_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 		// first, make sure we have a timing event, so we are in sync
 
 		// process each track
-		for (i=0; i<NB_TRACKS; i++) {
+		for (i=0; i<nb_tracks; i++) {
 
 
 			/**************************************************/
@@ -501,6 +590,15 @@ int midi_clock_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 				// a new record event has appeared, and it was not here previously : treat record event
 				if (track[i].status[RECORD] == PENDING_ON) {
 
+					// in mmap mode, track may play its read-only session file: it gets new audio buffers from the audio pool
+					detach (i);
+					// while a save is running, the blocks of the track may still be written to its session file: track gets new blocks too
+					if (pool_pinned ()) {
+						pool_release (track[i].left, 0);
+						pool_release (track[i].right, 0);
+					}
+					track[i].generation++;
+
 					// this is a new recording : set index (where to write in the track buffer) to 0
 					track[i].record_index_left = 0;
 					track[i].record_index_right = 0;
@@ -511,6 +609,9 @@ int midi_clock_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 					// set number of bars that are going to be recorded
 					track[i].record_nb_bar = number_of_bars;
 
+					// new take file for the write-behind recorder
+					recorder_start (i);
+
 					// set to next status (ie. ON)
 					track[i].status[RECORD] = ON;
 					// switch led on according to status
@@ -521,12 +622,36 @@ int midi_clock_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 				if (track[i].status[RECORD] == PENDING_OFF) {
 
 					// this is the end of the recording : set end index (index of end of the recording in the track audio buffer)
-					track[i].end_index_left = track[i].record_index_left + nframes;
-					track[i].end_index_right = track[i].record_index_right + nframes;
+					// audio has been recorded up to the frame of this clock event, so this is exact
+					track[i].end_index_left = track[i].record_index_left;
+					track[i].end_index_right = track[i].record_index_right;
 					// recording ends at current bar number
 					track[i].end_bar_left = BBT_bar;
 					track[i].end_bar_right = BBT_bar;
 
+					// in bar mode, loop length shall be the exact length of the bars recorded, as given by the tempo estimator (so long loops do not drift)
+					// recording is trimmed or padded with silence accordingly, unless the difference is more than a tick (tempo has changed while recording)
+					length = (is_pending_action (i) == ON_BBT) ? time_bars_length (track[i].end_bar_left - track[i].record_bar_left) : 0;
+					if ((length > 0) && (fabs ((double) length - (double) track[i].end_index_left) <= tempo_spt (&tempo))) {
+						if (length > track[i].end_index_left) {
+							pool_clear (track[i].left, track[i].end_index_left, length - track[i].end_index_left);
+							pool_clear (track[i].right, track[i].end_index_right, length - track[i].end_index_right);
+						}
+						track[i].end_index_left = length;
+						track[i].end_index_right = length;
+					}
+
+					// tempo of the recording, used to resample the loop if the tempo changes
+					track[i].record_spt = tempo_spt (&tempo);
+					track[i].play_ratio = 0.0;
+
+					// blocks which are after the end of the recording (from a previous recording) go back to the audio pool
+					pool_release (track[i].left, track[i].end_index_left);
+					pool_release (track[i].right, track[i].end_index_right);
+
+					// take file is complete
+					recorder_end (i, track[i].end_index_left);
+
 					// set to next status (ie. OFF)
 					track[i].status[RECORD] = OFF;
 					// switch led on according to status
@@ -557,6 +682,8 @@ int midi_clock_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 					// this is a new playing : set index (where to read in the track buffer) to 0 */
 					track[i].play_index_left = 0;
 					track[i].play_index_right = 0;
+					track[i].play_frac_left = 0.0;
+					track[i].play_frac_right = 0.0;
 					// playing starts at current bar number
 					track[i].play_bar_left = BBT_bar;
 					track[i].play_bar_right = BBT_bar;
@@ -579,24 +706,50 @@ int midi_clock_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 					led (i, PLAY, track[i].status[PLAY]);
 				}
 
+				// check if we are in BBT mode, and we have a new bar
+				// check if length played in bar is equal to length in bar of what has been recorded; if this is the case, then loop from this frame
+				// loops have the exact length of their bars, so these have usually just looped by themselves (less than a tick ago): index is then kept, to avoid a jump
+				if ((is_pending_action (i) == ON_BBT) && (track[i].status[PLAY] == ON)) {
+					if ((BBT_bar - track[i].play_bar_left) >= (track[i].end_bar_left - track[i].record_bar_left)) {
+						if (track[i].play_index_left >= tempo_spt (&tempo)) {
+							track[i].play_index_left = 0;
+							track[i].play_frac_left = 0.0;
+						}
+						track[i].play_bar_left = BBT_bar;
+					}
+					if ((BBT_bar - track[i].play_bar_right) >= (track[i].end_bar_right - track[i].record_bar_right)) {
+						if (track[i].play_index_right >= tempo_spt (&tempo)) {
+							track[i].play_index_right = 0;
+							track[i].play_frac_right = 0.0;
+						}
+						track[i].play_bar_right = BBT_bar;
+					}
+				}
+
 
 				/*********************/
 				/* DELETE processing */
 				/*********************/
 				if (track[i].status[DELETE] == PENDING_ON) {
 
-					/* set audio buffer of the track to 0 : we take the max size, plus add some more room (8192) to avoid overflows */
-					/* this coud be time consuming so let's comment for now */
-					//memset (track [i].left, 0, (NB_SAMPLES + 8192) * sizeof (jack_default_audio_sample_t));
-					//memset (track [i].right, 0, (NB_SAMPLES + 8192) * sizeof (jack_default_audio_sample_t));
+					/* give all the blocks of the audio buffers back to the audio pool: the pool thread will set them to 0 */
+					/* in mmap mode, blocks of the mapped session file are just removed from the track */
+					detach (i);
+					pool_release (track [i].left, 0);
+					pool_release (track [i].right, 0);
+					track[i].generation++;
 
 					// also reset key variables (playing and recording index, status, etc)
 					track[i].play_index_left = 0;
 					track[i].play_index_right = 0;
+					track[i].play_frac_left = 0.0;
+					track[i].play_frac_right = 0.0;
 					track[i].record_index_left = 0;
 					track[i].record_index_right = 0;
 					track[i].last_sample_left = 0.0;
 					track[i].last_sample_right = 0.0;
+					track[i].record_spt = 0.0;
+					track[i].play_ratio = 0.0;
 					track[i].end_index_left = 0;
 					track[i].end_index_right = 0;
 					track[i].record_bar_left = 0;
@@ -628,5 +781,7 @@ int midi_clock_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 			}
 		}
 	}
+
+	return 0;
 }
 
@@ -0,0 +1,373 @@
+/** @file recorder.c
+ *
+ * @brief Write-behind recorder: audio recorded by the realtime thread is streamed to disk while recording, in one take file per track.
+ * The realtime thread pushes the recorded samples to a lock-free ring, which is drained by a (non realtime) writer thread.
+ * When saving, the take files just have to be renamed as session files: only metadata has to be written.
+ * As take files are regularly synced to disk, takes are not lost in case of power loss.
+ *
+ * Track audio files contain a header (see disk.c), left samples from offset LEFT_OFFSET, and right samples from offset RIGHT_OFFSET (files are sparse).
+ * Checksums of the blocks are computed while recording, so the header is ready at the end of the take.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "led.h"
+#include "time.h"
+#include "utils.h"
+#include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
+#include <fcntl.h>
+
+
+static jack_ringbuffer_t *record_ring;				// recorded audio, from realtime thread to writer thread
+static sem_t record_sem;							// wakes up writer thread
+static pthread_t writer_thread_id;
+static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;	// protects take files and take states between writer thread and main thread
+static int take_fd [MAX_TRACKS];					// file descriptor of the take file of each track (-1 if none)
+static int take_state [MAX_TRACKS];					// state of the take of each track (TAKE_NONE, TAKE_RECORDING...)
+static jack_nframes_t take_unsynced [MAX_TRACKS];	// number of samples written since last sync to disk
+static int is_dropped [MAX_TRACKS];					// TRUE if recorded audio had to be dropped during the take (used by realtime thread only)
+static unsigned int take_id [MAX_TRACKS];			// take of each track: incremented by realtime thread each time the audio of the track is replaced (new take, load, stretch)
+static unsigned int writer_take [MAX_TRACKS];		// last take of each track seen by writer thread: it differs from take_id if a record has been dropped
+static unsigned int records_sent;					// number of records sent by realtime thread
+static unsigned int records_written;				// number of records processed by writer thread
+static jack_default_audio_sample_t *samples;		// writer thread buffer, to get the samples from the ring
+static jack_nframes_t max_frames;					// size of the writer thread buffer, for each channel
+static jack_default_audio_sample_t *block;			// writer thread buffer, to read back the last block of a take
+static unsigned int take_crc [MAX_TRACKS] [2] [NB_BLOCKS];	// checksums of the blocks of each take (left, right)
+
+
+// name of the take file of a track
+static void take_name (int tracknum, char *name) {
+
+	sprintf (name, "%s.%d", TAKE_FILE, tracknum + 1);
+}
+
+
+// update checksums of the blocks of a channel with "nframes" samples recorded at position "index"
+// samples are recorded in sequence, so checksum of a block is restarted when its first sample is recorded
+static void writer_crc (unsigned int *crc, jack_nframes_t index, jack_default_audio_sample_t *data, jack_nframes_t nframes) {
+
+	jack_nframes_t b, n;
+
+	while (nframes > 0) {
+		b = index >> POOL_BLOCK_SHIFT;
+		n = POOL_BLOCK - (index & POOL_BLOCK_MASK);
+		if (n > nframes) n = nframes;
+		if (b >= NB_BLOCKS) return;
+		if ((index & POOL_BLOCK_MASK) == 0) crc [b] = 0;
+		crc [b] = crc32 (crc [b], data, n * sizeof (jack_default_audio_sample_t));
+		index += n;
+		data += n;
+		nframes -= n;
+	}
+}
+
+
+// end of a take of "length" samples: checksum of the last block is computed again from the file (it may have been recorded after the end of the take)
+// then file is truncated to the end of the take, and header is written; returns 1 if take file is complete
+static int writer_finalize (int tracknum, jack_nframes_t length) {
+
+	int fd = take_fd [tracknum];
+	jack_nframes_t b, n;
+	ssize_t got;
+	int c;
+
+	if (length > 0) {
+		b = (length - 1) >> POOL_BLOCK_SHIFT;
+		n = length - (b << POOL_BLOCK_SHIFT);
+		for (c = 0; c < 2; c++) {
+			// samples which are not in the file (sparse file) are silence
+			got = pread (fd, block, n * sizeof (jack_default_audio_sample_t), (c ? RIGHT_OFFSET : LEFT_OFFSET) + ((off_t) b << POOL_BLOCK_SHIFT) * sizeof (jack_default_audio_sample_t));
+			if (got < 0) return 0;
+			memset ((char *) block + got, 0, n * sizeof (jack_default_audio_sample_t) - got);
+			take_crc [tracknum][c][b] = crc32 (0, block, n * sizeof (jack_default_audio_sample_t));
+		}
+	}
+
+	if (ftruncate (fd, RIGHT_OFFSET + (off_t) length * sizeof (jack_default_audio_sample_t)) != 0) return 0;
+	if (!write_track_header (fd, length, length, take_crc [tracknum][0], take_crc [tracknum][1])) return 0;
+	return (fdatasync (fd) == 0);
+}
+
+
+// process one record of the ring; returns 0 if there is no complete record in the ring
+static int writer_process () {
+
+	record_t rec;
+	size_t length;
+	char name [64];
+
+	// check we have a complete record (ie. header and samples) before reading it
+	if (jack_ringbuffer_peek (record_ring, (char *) &rec, sizeof (record_t)) != sizeof (record_t)) return 0;
+	length = (rec.type == REC_DATA) ? (2 * rec.nframes * sizeof (jack_default_audio_sample_t)) : 0;
+	if (jack_ringbuffer_read_space (record_ring) < sizeof (record_t) + length) return 0;
+
+	jack_ringbuffer_read_advance (record_ring, sizeof (record_t));
+	if (length) jack_ringbuffer_read (record_ring, (char *) samples, length);
+
+	pthread_mutex_lock (&disk_mutex);
+	switch (rec.type) {
+
+		// new take: create (or clear) take file of the track
+		case REC_START:
+			writer_take [rec.tracknum] = rec.take;
+			if (take_fd [rec.tracknum] >= 0) close (take_fd [rec.tracknum]);
+			take_name (rec.tracknum, name);
+			take_fd [rec.tracknum] = open (name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+			if (take_fd [rec.tracknum] < 0) fprintf ( stderr, "Cannot create take file %s.\n", name );
+			take_state [rec.tracknum] = TAKE_RECORDING;
+			take_unsynced [rec.tracknum] = 0;
+			break;
+
+		// recorded samples: left and right samples are written at their position in the file
+		case REC_DATA:
+			if ((take_fd [rec.tracknum] < 0) || (rec.take != writer_take [rec.tracknum])) break;
+			if ((pwrite (take_fd [rec.tracknum], samples, rec.nframes * sizeof (jack_default_audio_sample_t), LEFT_OFFSET + (off_t) rec.index * sizeof (jack_default_audio_sample_t)) < 0) ||
+				(pwrite (take_fd [rec.tracknum], samples + rec.nframes, rec.nframes * sizeof (jack_default_audio_sample_t), RIGHT_OFFSET + (off_t) rec.index * sizeof (jack_default_audio_sample_t)) < 0)) {
+				fprintf ( stderr, "Cannot write take file of track %d.\n", rec.tracknum + 1 );
+				take_state [rec.tracknum] = TAKE_DROPPED;
+				break;
+			}
+			writer_crc (take_crc [rec.tracknum][0], rec.index, samples, rec.nframes);
+			writer_crc (take_crc [rec.tracknum][1], rec.index, samples + rec.nframes, rec.nframes);
+			// sync to disk regularly (about every second), so take is not lost in case of power loss
+			take_unsynced [rec.tracknum] += rec.nframes;
+			if (take_unsynced [rec.tracknum] >= sample_rate) {
+				fdatasync (take_fd [rec.tracknum]);
+				take_unsynced [rec.tracknum] = 0;
+			}
+			break;
+
+		// end of take (rec.index is the length of the take): take is complete, unless some audio has been dropped
+		// start of the take may have been dropped: take file is then the one of a previous take
+		case REC_END:
+			if (rec.take != writer_take [rec.tracknum]) {
+				take_state [rec.tracknum] = TAKE_DROPPED;
+				break;
+			}
+			if (take_state [rec.tracknum] != TAKE_RECORDING) break;
+			if (rec.arg || (take_fd [rec.tracknum] < 0) || !writer_finalize (rec.tracknum, rec.index)) take_state [rec.tracknum] = TAKE_DROPPED;
+			else take_state [rec.tracknum] = TAKE_COMPLETE;
+			break;
+
+		// track has been loaded from session: its audio is already in the session file
+		case REC_LOADED:
+			writer_take [rec.tracknum] = rec.take;
+			take_state [rec.tracknum] = TAKE_SAVED;
+			break;
+
+		// track has been stretched: its audio is only in memory, and shall be written from memory at next save
+		case REC_CHANGED:
+			writer_take [rec.tracknum] = rec.take;
+			take_state [rec.tracknum] = TAKE_NONE;
+			break;
+	}
+	pthread_mutex_unlock (&disk_mutex);
+
+	__atomic_add_fetch (&records_written, 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+
+// writer thread: writes recorded audio to take files
+static void *writer_thread (void *arg) {
+
+	while (1) {
+		sem_wait (&record_sem);
+		while (writer_process ());
+	}
+
+	return NULL;
+}
+
+
+// create record ring (about RECORDER_SECONDS of stereo audio), and start writer thread
+int recorder_init () {
+
+	int i;
+
+	for (i = 0; i < MAX_TRACKS; i++) {
+		take_fd [i] = -1;
+		take_state [i] = TAKE_NONE;
+		is_dropped [i] = FALSE;
+		take_id [i] = 0;
+		writer_take [i] = 0;
+	}
+
+	record_ring = jack_ringbuffer_create (RECORDER_SECONDS * sample_rate * 2 * sizeof (jack_default_audio_sample_t));
+	max_frames = nb_frames_per_packet;
+	samples = calloc (2 * max_frames, sizeof (jack_default_audio_sample_t));
+	block = calloc (POOL_BLOCK, sizeof (jack_default_audio_sample_t));
+	if ((record_ring == NULL) || (samples == NULL) || (block == NULL)) {
+		fprintf ( stderr, "error in creating recorder ring.\n" );
+		exit ( 1 );
+	}
+	jack_ringbuffer_mlock (record_ring);
+
+	sem_init (&record_sem, 0, 0);
+	if (pthread_create (&writer_thread_id, NULL, writer_thread, NULL) != 0) {
+		fprintf ( stderr, "error in creating recorder thread.\n" );
+		exit ( 1 );
+	}
+
+	return 0;
+}
+
+
+/**************************************/
+/* functions for the realtime thread  */
+/**************************************/
+
+// send a record without samples to the writer thread
+// records which replace the audio of the track (new take, load, stretch) start a new take of the track, even if they are dropped
+static void recorder_send (int type, int tracknum, jack_nframes_t index, int arg) {
+
+	record_t rec;
+
+	if ((type == REC_START) || (type == REC_LOADED) || (type == REC_CHANGED)) __atomic_store_n (&take_id [tracknum], take_id [tracknum] + 1, __ATOMIC_RELEASE);
+
+	// this should never happen, as ring is large enough to get several seconds of audio
+	if (jack_ringbuffer_write_space (record_ring) < sizeof (record_t)) {
+		is_dropped [tracknum] = TRUE;
+		return;
+	}
+
+	rec.type = type;
+	rec.tracknum = tracknum;
+	rec.index = index;
+	rec.nframes = 0;
+	rec.arg = arg;
+	rec.take = take_id [tracknum];
+	jack_ringbuffer_write (record_ring, (char *) &rec, sizeof (record_t));
+	__atomic_add_fetch (&records_sent, 1, __ATOMIC_RELEASE);
+	sem_post (&record_sem);
+}
+
+
+// new take for a track
+void recorder_start (int tracknum) {
+
+	is_dropped [tracknum] = FALSE;
+	recorder_send (REC_START, tracknum, 0, 0);
+}
+
+
+// recorded samples of a track, at position "index" of the take
+// if the writer thread cannot follow, samples are dropped: take will then be saved from memory
+void recorder_write (int tracknum, jack_nframes_t index, jack_default_audio_sample_t *left, jack_default_audio_sample_t *right, jack_nframes_t nframes) {
+
+	record_t rec;
+
+	if ((nframes > max_frames) || (jack_ringbuffer_write_space (record_ring) < sizeof (record_t) + (2 * nframes * sizeof (jack_default_audio_sample_t)))) {
+		is_dropped [tracknum] = TRUE;
+		return;
+	}
+
+	rec.type = REC_DATA;
+	rec.tracknum = tracknum;
+	rec.index = index;
+	rec.nframes = nframes;
+	rec.arg = 0;
+	rec.take = take_id [tracknum];
+	jack_ringbuffer_write (record_ring, (char *) &rec, sizeof (record_t));
+	jack_ringbuffer_write (record_ring, (char *) left, nframes * sizeof (jack_default_audio_sample_t));
+	jack_ringbuffer_write (record_ring, (char *) right, nframes * sizeof (jack_default_audio_sample_t));
+	__atomic_add_fetch (&records_sent, 1, __ATOMIC_RELEASE);
+	sem_post (&record_sem);
+}
+
+
+// end of take for a track; "length" is the number of samples of the take
+void recorder_end (int tracknum, jack_nframes_t length) {
+
+	recorder_send (REC_END, tracknum, length, is_dropped [tracknum]);
+}
+
+
+// track has been loaded from session
+void recorder_loaded (int tracknum) {
+
+	recorder_send (REC_LOADED, tracknum, 0, 0);
+}
+
+
+// audio of a track has been replaced in memory
+void recorder_changed (int tracknum) {
+
+	recorder_send (REC_CHANGED, tracknum, 0, 0);
+}
+
+
+// returns the current take of a track, which is saved with the snapshot of the track (see snapshot)
+unsigned int recorder_take (int tracknum) {
+
+	return take_id [tracknum];
+}
+
+
+/******************************************/
+/* functions for the main thread          */
+/******************************************/
+
+// wait until the writer thread has written all the audio recorded so far
+void recorder_flush () {
+
+	unsigned int sent = __atomic_load_n (&records_sent, __ATOMIC_ACQUIRE);
+
+	while ((int) (__atomic_load_n (&records_written, __ATOMIC_ACQUIRE) - sent) < 0) {
+		sem_post (&record_sem);
+		usleep (1000);
+	}
+}
+
+
+// save audio of take "id" of a track in session file "name": if this take is complete, take file just becomes the session file
+// returns 1 if audio of the track is in the session file, 0 if it shall be written from memory (take is not complete, some audio has been dropped,
+// or a new take has started since the snapshot of the track)
+// recorder_flush shall be called before: if writer thread has then not seen the take, a record has been dropped
+int recorder_save (int tracknum, unsigned int id, const char *name) {
+
+	char take [64];
+	int ret = 0;
+
+	pthread_mutex_lock (&disk_mutex);
+	if ((int) (writer_take [tracknum] - id) < 0) take_state [tracknum] = TAKE_DROPPED;
+	if (writer_take [tracknum] == id) switch (take_state [tracknum]) {
+		case TAKE_COMPLETE:
+			take_name (tracknum, take);
+			fdatasync (take_fd [tracknum]);
+			if (rename (take, name) == 0) {
+				take_state [tracknum] = TAKE_SAVED;
+				ret = 1;
+			}
+			else fprintf ( stderr, "Cannot rename take file %s.\n", take );
+			break;
+		case TAKE_SAVED:
+			ret = 1;
+			break;
+	}
+	pthread_mutex_unlock (&disk_mutex);
+
+	return ret;
+}
+
+
+// audio of take "id" of a track has been written from memory to its session file
+void recorder_saved (int tracknum, unsigned int id) {
+
+	pthread_mutex_lock (&disk_mutex);
+	if ((writer_take [tracknum] == id) && (take_state [tracknum] != TAKE_RECORDING)) take_state [tracknum] = TAKE_SAVED;
+	pthread_mutex_unlock (&disk_mutex);
+}
@@ -0,0 +1,16 @@
+/** @file recorder.h
+ *
+ * @brief This file defines prototypes of functions inside recorder.c
+ *
+ */
+
+int recorder_init ();
+void recorder_start (int);
+void recorder_write (int, jack_nframes_t, jack_default_audio_sample_t *, jack_default_audio_sample_t *, jack_nframes_t);
+void recorder_end (int, jack_nframes_t);
+void recorder_loaded (int);
+void recorder_changed (int);
+unsigned int recorder_take (int);
+void recorder_flush ();
+int recorder_save (int, unsigned int, const char *);
+void recorder_saved (int, unsigned int);
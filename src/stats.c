@@ -0,0 +1,180 @@
+/** @file stats.c
+ *
+ * @brief Timing statistics of the process callback: the time of each stage (midi, playback, recording, leds...) is measured
+ * with a monotonic clock, and min, average, max and histogram of each stage are kept in a shared memory block, along with the xruns
+ * and the worst times of the stages before each xrun. The block is read by boocli_stats, while boocli is running.
+ * The realtime thread is the only writer of the block; readers use the sequence number to get a consistent copy.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "led.h"
+#include "time.h"
+#include "utils.h"
+#include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
+#include <fcntl.h>
+#include <limits.h>
+
+
+static stats_t *stats = NULL;					// shared memory block; NULL if statistics are off
+
+// measures of the current cycle (used by realtime thread only)
+static struct timespec stage_start [LAST_STAGE];	// time when each stage has started
+static unsigned int stage_time [LAST_STAGE];	// time of each stage in the current cycle, in ns (a stage may run several times in a cycle)
+static unsigned int cycle_tracks;				// number of tracks playing or recording in the current cycle
+static unsigned int window_max [LAST_STAGE];	// worst time of each stage in the current second
+static unsigned int previous_max [LAST_STAGE];	// worst time of each stage in the previous second
+static unsigned int window_cycles;				// number of cycles in the current second
+
+// xruns reported by JACK, not yet recorded by realtime thread
+static int xrun_pending = 0;
+static float xrun_delay = 0.0f;
+
+
+// xrun callback (called by JACK in a non realtime thread): xrun is recorded by realtime thread at the end of next cycle
+static int stats_xrun (void *arg) {
+
+	xrun_delay = jack_get_xrun_delayed_usecs (client);
+	__sync_fetch_and_add (&xrun_pending, 1);
+	return 0;
+}
+
+
+// create the shared memory block of the statistics, and get the xruns from JACK; shall be called before jack_activate
+int stats_init () {
+
+	int fd, i;
+
+	if (!is_stats) return 0;
+
+	fd = shm_open (STATS_SHM, O_CREAT | O_RDWR, 0644);
+	if (fd < 0) {
+		fprintf ( stderr, "Cannot create stats block %s (%s): no timing statistics.\n", STATS_SHM, strerror (errno) );
+		return 0;
+	}
+	if (ftruncate (fd, sizeof (stats_t)) == 0) stats = mmap (NULL, sizeof (stats_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if ((stats == NULL) || (stats == MAP_FAILED)) {
+		fprintf ( stderr, "Cannot map stats block %s (%s): no timing statistics.\n", STATS_SHM, strerror (errno) );
+		stats = NULL;
+		return 0;
+	}
+
+	memset (stats, 0, sizeof (stats_t));
+	stats->magic = STATS_MAGIC;
+	stats->version = STATS_VERSION;
+	stats->sample_rate = sample_rate;
+	stats->nframes = nb_frames_per_packet;
+	stats->nb_tracks = nb_tracks;
+	for (i = FIRST_STAGE; i < LAST_STAGE; i++) stats->stage [i].min = UINT_MAX;
+
+	jack_set_xrun_callback (client, stats_xrun, NULL);
+	return 1;
+}
+
+
+/**************************************/
+/* functions for the realtime thread  */
+/**************************************/
+
+// start measuring a stage
+void stats_begin (int stage) {
+
+	if (stats == NULL) return;
+	clock_gettime (CLOCK_MONOTONIC, &stage_start [stage]);
+}
+
+
+// stop measuring a stage: its time is added to the time of the stage in the cycle
+void stats_end (int stage) {
+
+	struct timespec now;
+
+	if (stats == NULL) return;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	stage_time [stage] += (unsigned int) ((now.tv_sec - stage_start [stage].tv_sec) * 1000000000L + (now.tv_nsec - stage_start [stage].tv_nsec));
+}
+
+
+// number of tracks playing or recording in a part of the cycle
+void stats_tracks (int n) {
+
+	if ((unsigned int) n > cycle_tracks) cycle_tracks = n;
+}
+
+
+// start measuring a cycle; shall be called at the beginning of the process callback
+void stats_cycle_begin () {
+
+	if (stats == NULL) return;
+	memset (stage_time, 0, sizeof (stage_time));
+	cycle_tracks = 0;
+	stats_begin (STAGE_CYCLE);
+}
+
+
+// stop measuring a cycle, and publish the times of its stages, and the xruns reported since previous cycle; shall be called at the end of the process callback
+void stats_cycle_end () {
+
+	stage_stats_t *s;
+	xrun_stats_t *x;
+	unsigned int t, us;
+	int i, pending, bin;
+
+	if (stats == NULL) return;
+	stats_end (STAGE_CYCLE);
+	pending = __sync_fetch_and_and (&xrun_pending, 0);
+
+	// block is being written
+	stats->sequence++;
+	__sync_synchronize ();
+
+	for (i = FIRST_STAGE; i < LAST_STAGE; i++) {
+		s = &stats->stage [i];
+		t = stage_time [i];
+		s->last = t;
+		if (t < s->min) s->min = t;
+		if (t > s->max) s->max = t;
+		s->sum += t;
+		us = t / 1000;
+		bin = (us < 2) ? 0 : (31 - __builtin_clz (us));
+		if (bin >= STATS_BINS) bin = STATS_BINS - 1;
+		s->histogram [bin]++;
+		if (t > window_max [i]) window_max [i] = t;
+	}
+	stats->cycles++;
+	stats->tracks = cycle_tracks;
+	if (cycle_tracks > stats->tracks_max) stats->tracks_max = cycle_tracks;
+
+	// xruns are linked to the worst times of the stages in the last 1 to 2 seconds
+	if (pending > 0) {
+		x = &stats->xrun [stats->xruns % STATS_XRUNS];
+		x->cycle = stats->cycles;
+		x->delay = xrun_delay;
+		for (i = FIRST_STAGE; i < LAST_STAGE; i++) x->worst [i] = (window_max [i] > previous_max [i]) ? window_max [i] : previous_max [i];
+		stats->xruns += pending;
+	}
+
+	// block is consistent again
+	__sync_synchronize ();
+	stats->sequence++;
+
+	// new second
+	if (++window_cycles >= stats->sample_rate / stats->nframes) {
+		memcpy (previous_max, window_max, sizeof (window_max));
+		memset (window_max, 0, sizeof (window_max));
+		window_cycles = 0;
+	}
+}
@@ -0,0 +1,12 @@
+/** @file stats.h
+ *
+ * @brief This file defines prototypes of functions inside stats.c
+ *
+ */
+
+int stats_init ();
+void stats_cycle_begin ();
+void stats_cycle_end ();
+void stats_begin (int);
+void stats_end (int);
+void stats_tracks (int);
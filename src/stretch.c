@@ -0,0 +1,447 @@
+/** @file stretch.c
+ *
+ * @brief Time-stretch of a track to the bar length of the current tempo, keeping its pitch (WSOLA: waveform similarity overlap-add).
+ * The realtime thread asks the main thread to stretch a track; the track is rendered again by worker threads (one per core)
+ * into spare audio buffers, while the track keeps playing. Stretched track is then swapped with the track at the next bar,
+ * unless the track has been recorded, deleted or loaded in between (see track_t generation).
+ *
+ * The stretched track is made of frames of STRETCH_WINDOW samples of the track, taken every STRETCH_HOP samples and overlapped with a Hann window.
+ * Each frame is taken around its nominal position in the track, at the position which best matches the continuation of the previous frame.
+ * Loops are cyclic: frames wrap around the end of the track, and at the end of the stretched track, so the stretched loop is seamless.
+ * Work is done in 2 phases, both split between the worker threads: best positions of the frames, then overlap-add of the frames.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "led.h"
+#include "time.h"
+#include "utils.h"
+#include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
+
+
+static int is_stretch = OFF;				// OFF: no stretch, PENDING_ON: track is being stretched, ON: stretched track will be swapped at next bar, PENDING_OFF: swap done, previous audio buffers are being released
+static jack_default_audio_sample_t **stretch_left;	// stretched audio buffer (left), swapped with the audio buffer of the track
+static jack_default_audio_sample_t **stretch_right;	// stretched audio buffer (right)
+static int stretch_map;						// in mmap mode, mapping of the previous audio buffers of the track once swapped (0 if none)
+
+// stretch request, set by realtime thread before the command is sent
+static int job_track;						// track to stretch
+static unsigned int job_generation;			// generation of the track audio when stretch has been requested
+static jack_nframes_t job_length;			// length of the stretched track
+static double job_spt;						// tempo of the stretched track, in samples per tick
+
+// work shared by the worker threads
+static jack_default_audio_sample_t **job_left;		// audio buffers of the track (read only: track keeps playing)
+static jack_default_audio_sample_t **job_right;
+static jack_nframes_t job_input;			// length of the track
+static int job_frames;						// number of frames of the stretched track
+static int job_threads;						// number of worker threads
+static jack_nframes_t *job_pos;				// position of each frame in the track
+static pthread_barrier_t job_barrier;		// first phase (positions of the frames) shall be complete before the second one (overlap-add)
+static unsigned int job_done;				// number of steps done by worker threads (2 per frame), for progress
+static unsigned int job_total;				// number of steps of the job (0 while unknown)
+static float window [STRETCH_WINDOW];		// Hann window
+
+
+// create stretch audio buffers and window
+int stretch_init () {
+
+	int i;
+
+	stretch_left = pool_buffer ();
+	stretch_right = pool_buffer ();
+	for (i = 0; i < STRETCH_WINDOW; i++) {
+		// window is sampled between its points, so no sample gets a zero weight
+		window [i] = 0.5f - (0.5f * cosf (2.0f * (float) M_PI * ((float) i + 0.5f) / STRETCH_WINDOW));
+	}
+
+	return 0;
+}
+
+
+/**************************************/
+/* functions for the realtime thread  */
+/**************************************/
+
+// ask main thread to stretch a track to the bar length of the current tempo; stretch led shows the progress
+// returns 1 if the request has been sent
+int stretch_request (int tracknum) {
+
+	jack_nframes_t length = track[tracknum].end_index_left;
+	jack_nframes_t bars = track[tracknum].end_bar_left - track[tracknum].record_bar_left;
+	jack_nframes_t new_length = 0;
+
+	// a single stretch at a time, of a track which is neither empty nor being recorded, and once the tempo is known
+	if ((is_stretch != OFF) || (length < 2 * STRETCH_WINDOW) || (track[tracknum].status[RECORD] != OFF) || !tempo_locked (&tempo)) return 0;
+
+	// bar mode: stretched loop has the exact length of its bars at current tempo
+	if ((track[tracknum].status[MODE] == OFF) && (bars > 0)) new_length = time_bars_length (bars);
+	// free mode: loop length follows the ratio of the tempo of the recording to the current tempo
+	else if (track[tracknum].record_spt > 0.0) new_length = (jack_nframes_t) floor ((length * tempo_spt (&tempo) / track[tracknum].record_spt) + 0.5);
+
+	if ((new_length == 0) || (new_length == length)) return 0;
+	if ((new_length < STRETCH_MIN * length) || (new_length > STRETCH_MAX * length) || (new_length >= NB_SAMPLES)) return 0;
+
+	job_track = tracknum;
+	job_generation = track[tracknum].generation;
+	job_length = new_length;
+	job_spt = tempo_spt (&tempo);
+	__atomic_store_n (&job_done, 0, __ATOMIC_RELAXED);
+	__atomic_store_n (&job_total, 0, __ATOMIC_RELAXED);
+	if (!command_send (CMD_STRETCH, tracknum)) return 0;
+
+	is_stretch = PENDING_ON;
+	led (tracknum, STRETCH, PENDING_ON);
+	return 1;
+}
+
+
+// show the progress of the stretch on the stretch led: pending on for the first half, pending off for the second half
+void stretch_progress () {
+
+	unsigned int total;
+
+	if (is_stretch != PENDING_ON) return;
+	total = __atomic_load_n (&job_total, __ATOMIC_RELAXED);
+	if ((total > 0) && (2 * __atomic_load_n (&job_done, __ATOMIC_RELAXED) >= total)) led (job_track, STRETCH, PENDING_OFF);
+}
+
+
+// main thread has stretched the track (done is 1) or has failed (done is 0)
+void stretch_reply (int done) {
+
+	// stretched track will be swapped at next bar: stretch led on until then
+	if (done) {
+		is_stretch = ON;
+		led (job_track, STRETCH, ON);
+	}
+	else {
+		is_stretch = OFF;
+		led (job_track, STRETCH, OFF);
+	}
+}
+
+
+// previous audio buffers of the stretched track are back in the audio pool: a new stretch can be requested
+void stretch_recycled () {
+
+	is_stretch = OFF;
+}
+
+
+// called at each new bar: swap stretched track with the track
+// stretched track is dropped if the track has been recorded, deleted or loaded since the stretch has been requested
+int stretch_swap () {
+
+	track_t *t = &track[job_track];
+	jack_default_audio_sample_t **buffer;
+
+	if (is_stretch != ON) return 0;
+
+	if ((t->generation == job_generation) && (t->status[RECORD] == OFF)) {
+
+		// swap audio buffers; in mmap mode, previous buffers may point into the session file, which will be unmapped
+		buffer = t->left;
+		t->left = stretch_left;
+		stretch_left = buffer;
+		buffer = t->right;
+		t->right = stretch_right;
+		stretch_right = buffer;
+		stretch_map = t->map;
+		t->map = 0;
+
+		// play position is kept at the same place in the loop
+		t->play_index_left = (jack_nframes_t) (((double) t->play_index_left * job_length) / t->end_index_left);
+		t->play_index_right = (jack_nframes_t) (((double) t->play_index_right * job_length) / t->end_index_right);
+		if (t->play_index_left >= job_length) t->play_index_left = 0;
+		if (t->play_index_right >= job_length) t->play_index_right = 0;
+		t->play_frac_left = 0.0;
+		t->play_frac_right = 0.0;
+		t->end_index_left = job_length;
+		t->end_index_right = job_length;
+		t->record_spt = job_spt;
+		t->play_ratio = 0.0;
+		t->generation++;
+
+		// audio of the track is now only in memory
+		recorder_changed (job_track);
+	}
+
+	led (job_track, STRETCH, OFF);
+
+	// ask main thread to give previous (or dropped) audio buffers back to the audio pool
+	is_stretch = PENDING_OFF;
+	command_send (CMD_UNSTRETCH, 0);
+	return 1;
+}
+
+
+/******************************************/
+/* functions for the worker threads       */
+/******************************************/
+
+// position of frame k in the stretched track (k may be out of 0..job_frames, for frames which wrap around the end of the loop)
+static long long frame_start (long long k) {
+
+	long long cycle = (k >= 0) ? (k / job_frames) : (((k + 1) / job_frames) - 1);
+
+	k -= cycle * job_frames;
+	return (cycle * (long long) job_length) + ((k * (long long) job_length) / job_frames);
+}
+
+
+// nominal position of frame k in the track
+static jack_nframes_t frame_nominal (int k) {
+
+	return (jack_nframes_t) (((long long) k * job_input) / job_frames);
+}
+
+
+// read nframes samples of a track audio buffer from "index" (0 to job_input), wrapping around the end of the loop
+// blocks are read once, as the realtime thread may release these meanwhile: stretched track is then dropped anyway
+static void stretch_read (jack_default_audio_sample_t **buffer, jack_nframes_t index, jack_nframes_t nframes, float *dst) {
+
+	jack_default_audio_sample_t *block;
+	jack_nframes_t n;
+
+	while (nframes > 0) {
+		if (index >= job_input) index -= job_input;
+		n = POOL_BLOCK - (index & POOL_BLOCK_MASK);
+		if (n > nframes) n = nframes;
+		if (n > job_input - index) n = job_input - index;
+		block = __atomic_load_n (&buffer [index >> POOL_BLOCK_SHIFT], __ATOMIC_RELAXED);
+		if (block != NULL) memcpy (dst, block + (index & POOL_BLOCK_MASK), n * sizeof (float));
+		else memset (dst, 0, n * sizeof (float));
+		dst += n;
+		index += n;
+		nframes -= n;
+	}
+}
+
+
+// read nframes samples of left + right, from "index" (which may be out of the loop)
+static void stretch_read_mono (long long index, jack_nframes_t nframes, float *dst, float *tmp) {
+
+	jack_nframes_t i;
+
+	index %= job_input;
+	if (index < 0) index += job_input;
+	stretch_read (job_left, (jack_nframes_t) index, nframes, dst);
+	stretch_read (job_right, (jack_nframes_t) index, nframes, tmp);
+	for (i = 0; i < nframes; i++) dst [i] += tmp [i];
+}
+
+
+// similarity of the target with the candidate at "offset": cross-correlation, normalised by the energy of the candidate
+static float stretch_score (float *target, float *candidate, int offset, int step) {
+
+	float num = 0.0f;
+	float energy = 1e-9f;
+	int j;
+
+	for (j = 0; j < STRETCH_COMPARE; j += step) {
+		num += target [j] * candidate [offset + j];
+		energy += candidate [offset + j] * candidate [offset + j];
+	}
+
+	return num / sqrtf (energy);
+}
+
+
+// find the position of frame k in the track: around its nominal position, where it best matches the continuation of frame k-1
+static jack_nframes_t stretch_match (int k) {
+
+	float target [STRETCH_COMPARE];
+	float candidate [STRETCH_COMPARE + (2 * STRETCH_TOLERANCE)];
+	float tmp [STRETCH_COMPARE + (2 * STRETCH_TOLERANCE)];
+	long long start = (long long) frame_nominal (k) - STRETCH_TOLERANCE;
+	int d, best, coarse;
+	float score, best_score;
+
+	// continuation of frame k-1, at the place where frame k starts
+	stretch_read_mono ((long long) job_pos [k - 1] + frame_start (k) - frame_start (k - 1), STRETCH_COMPARE, target, tmp);
+	stretch_read_mono (start, STRETCH_COMPARE + (2 * STRETCH_TOLERANCE), candidate, tmp);
+
+	// coarse search (nominal position is kept in case of silence), then refined search around the best coarse match
+	best = STRETCH_TOLERANCE;
+	best_score = stretch_score (target, candidate, best, STRETCH_DECIMATE);
+	for (d = 0; d <= 2 * STRETCH_TOLERANCE; d += STRETCH_DECIMATE) {
+		score = stretch_score (target, candidate, d, STRETCH_DECIMATE);
+		if (score > best_score) {
+			best_score = score;
+			best = d;
+		}
+	}
+	coarse = best;
+	best_score = stretch_score (target, candidate, best, 1);
+	for (d = coarse - STRETCH_DECIMATE + 1; d < coarse + STRETCH_DECIMATE; d++) {
+		if ((d < 0) || (d > 2 * STRETCH_TOLERANCE) || (d == coarse)) continue;
+		score = stretch_score (target, candidate, d, 1);
+		if (score > best_score) {
+			best_score = score;
+			best = d;
+		}
+	}
+
+	start += best;
+	start %= job_input;
+	if (start < 0) start += job_input;
+	return (jack_nframes_t) start;
+}
+
+
+// overlap-add the frames which cover the samples of the stretched track from the start of frame k to the start of frame k+1
+// (frames k, k-1, k-2...); samples are normalised by the sum of the windows, as frames are not exactly STRETCH_HOP apart
+static void stretch_render (int k) {
+
+	float left [STRETCH_WINDOW], right [STRETCH_WINDOW], weight [STRETCH_WINDOW];
+	float in_left [STRETCH_WINDOW], in_right [STRETCH_WINDOW];
+	long long start = frame_start (k);
+	jack_nframes_t nframes = (jack_nframes_t) (frame_start (k + 1) - start);
+	jack_nframes_t offset, n, i;
+	long long j;
+	int f;
+
+	if (nframes > STRETCH_WINDOW) nframes = STRETCH_WINDOW;
+	memset (left, 0, nframes * sizeof (float));
+	memset (right, 0, nframes * sizeof (float));
+	memset (weight, 0, nframes * sizeof (float));
+
+	for (j = k; (j > k - 4) && (frame_start (j) + STRETCH_WINDOW > start); j--) {
+		// frame j covers the samples from "offset" in the frame
+		offset = (jack_nframes_t) (start - frame_start (j));
+		n = STRETCH_WINDOW - offset;
+		if (n > nframes) n = nframes;
+		f = (int) (((j % job_frames) + job_frames) % job_frames);
+		stretch_read (job_left, (jack_nframes_t) ((job_pos [f] + (long long) offset) % job_input), n, in_left);
+		stretch_read (job_right, (jack_nframes_t) ((job_pos [f] + (long long) offset) % job_input), n, in_right);
+		for (i = 0; i < n; i++) {
+			left [i] += window [offset + i] * in_left [i];
+			right [i] += window [offset + i] * in_right [i];
+			weight [i] += window [offset + i];
+		}
+	}
+
+	for (i = 0; i < nframes; i++) {
+		left [i] /= weight [i];
+		right [i] /= weight [i];
+	}
+	pool_write (stretch_left, (jack_nframes_t) start, left, nframes);
+	pool_write (stretch_right, (jack_nframes_t) start, right, nframes);
+}
+
+
+// worker thread: does its share of the frames, for both phases
+static void *stretch_thread (void *arg) {
+
+	int chunk = (int) (intptr_t) arg;
+	int first = (int) (((long long) chunk * job_frames) / job_threads);
+	int last = (int) (((long long) (chunk + 1) * job_frames) / job_threads);
+	int k;
+
+	// first frame of the share of the thread is at its nominal position, as previous frame is found by another thread
+	for (k = first; k < last; k++) {
+		job_pos [k] = (k == first) ? frame_nominal (k) : stretch_match (k);
+		__atomic_add_fetch (&job_done, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_barrier_wait (&job_barrier);
+
+	for (k = first; k < last; k++) {
+		stretch_render (k);
+		__atomic_add_fetch (&job_done, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+
+/******************************************/
+/* functions for the main thread          */
+/******************************************/
+
+// give audio buffers of the stretched track back to the audio pool
+// these are the previous buffers of the track once swapped, or the stretched buffers if the stretch has failed or has been dropped
+int unstretch () {
+
+	jack_nframes_t b;
+
+	// mapped session file: blocks are not in the audio pool
+	if (stretch_map) {
+		memset (stretch_left, 0, NB_BLOCKS * sizeof (jack_default_audio_sample_t *));
+		memset (stretch_right, 0, NB_BLOCKS * sizeof (jack_default_audio_sample_t *));
+		unmap (stretch_map);
+		stretch_map = 0;
+	}
+	for (b = 0; b < NB_BLOCKS; b++) {
+		if (stretch_left [b] != NULL) pool_free (stretch_left [b]);
+		if (stretch_right [b] != NULL) pool_free (stretch_right [b]);
+		stretch_left [b] = NULL;
+		stretch_right [b] = NULL;
+	}
+
+	return 1;
+}
+
+
+// function called in case user pressed the stretch pad of a track: render the track again at the length requested (job_length)
+// returns 1 if the stretched track is ready to be swapped
+int stretch () {
+
+	pthread_t threads [STRETCH_THREADS];
+	jack_nframes_t b;
+	long cores;
+	int i;
+
+	job_left = track[job_track].left;
+	job_right = track[job_track].right;
+	job_input = track[job_track].end_index_left;
+	job_frames = (int) ((job_length + (STRETCH_HOP / 2)) / STRETCH_HOP);
+	if ((job_input < 2 * STRETCH_WINDOW) || (job_frames < 4)) return 0;
+
+	// blocks of the stretched track are taken from the audio pool beforehand
+	for (b = 0; b < ((job_length + POOL_BLOCK_MASK) >> POOL_BLOCK_SHIFT); b++) {
+		if (((stretch_left [b] = pool_alloc ()) == NULL) || ((stretch_right [b] = pool_alloc ()) == NULL)) {
+			fprintf ( stderr, "Not enough memory in the audio pool to stretch track %d.\n", job_track + 1 );
+			unstretch ();
+			return 0;
+		}
+	}
+
+	job_pos = malloc (job_frames * sizeof (jack_nframes_t));
+	if (job_pos == NULL) {
+		unstretch ();
+		return 0;
+	}
+
+	// one worker thread per core
+	cores = sysconf (_SC_NPROCESSORS_ONLN);
+	job_threads = (cores < 1) ? 1 : ((cores > STRETCH_THREADS) ? STRETCH_THREADS : (int) cores);
+	__atomic_store_n (&job_total, 2 * job_frames, __ATOMIC_RELAXED);
+	pthread_barrier_init (&job_barrier, NULL, job_threads);
+
+	for (i = 1; i < job_threads; i++) {
+		if (pthread_create (&threads [i], NULL, stretch_thread, (void *) (intptr_t) i) != 0) {
+			fprintf ( stderr, "error in creating stretch thread.\n" );
+			exit ( 1 );
+		}
+	}
+	stretch_thread ((void *) 0);
+	for (i = 1; i < job_threads; i++) pthread_join (threads [i], NULL);
+
+	pthread_barrier_destroy (&job_barrier);
+	free (job_pos);
+	return 1;
+}
@@ -0,0 +1,14 @@
+/** @file stretch.h
+ *
+ * @brief This file defines prototypes of functions inside stretch.c
+ *
+ */
+
+int stretch_init ();
+int stretch_request (int);
+void stretch_progress ();
+void stretch_reply (int);
+void stretch_recycled ();
+int stretch_swap ();
+int unstretch ();
+int stretch ();
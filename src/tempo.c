@@ -0,0 +1,120 @@
+/** @file tempo.c
+ *
+ * @brief Tempo estimator: a delay-locked loop (DLL) filters the frame times of the midi clock ticks.
+ * This gives a smoothed tempo (bpm, samples per tick) and predicts the frame time of the next ticks, so jitter of the clock (USB, DIN) does not go into the bars.
+ * See "Using a DLL to filter time" (F. Adriaensen, 2005).
+ *
+ * Each clock source has its own estimator (tempo_t).
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "led.h"
+#include "time.h"
+#include "utils.h"
+#include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
+
+
+// init tempo estimator; "bandwidth" is the bandwidth of the loop, relative to the tick rate (the lower, the smoother)
+void tempo_init (tempo_t *t, double bandwidth) {
+
+	double omega = 2.0 * M_PI * bandwidth;
+
+	memset (t, 0, sizeof (tempo_t));
+	t->state = TEMPO_OFF;
+	t->b = sqrt (2.0) * omega;
+	t->c = omega * omega;
+}
+
+
+// tempo estimator loses its lock: it starts again at next tick
+void tempo_reset (tempo_t *t) {
+
+	t->state = TEMPO_OFF;
+}
+
+
+// new tick received at absolute frame time "frame" (jack frame time, which wraps around)
+void tempo_tick (tempo_t *t, jack_nframes_t frame) {
+
+	double e;
+
+	// times are kept unwrapped, relative to the first tick
+	if (t->state != TEMPO_OFF) t->time += (double) (jack_nframes_t) (frame - t->frame);
+	else t->time = 0.0;
+	t->frame = frame;
+
+	switch (t->state) {
+
+		// first tick: nothing to measure yet
+		case TEMPO_OFF:
+			t->t0 = t->time;
+			t->state = TEMPO_START;
+			break;
+
+		// second tick: first measure of the period
+		case TEMPO_START:
+			t->period = t->time - t->t0;
+			t->t0 = t->time;
+			t->t1 = t->t0 + t->period;
+			t->state = (t->period > 0.0) ? TEMPO_LOCKED : TEMPO_START;
+			break;
+
+		// next ticks: the loop filters the error between tick time and predicted tick time
+		case TEMPO_LOCKED:
+			e = t->time - t->t1;
+			// error of more than one tick (tempo jump, missing ticks): start again from this tick
+			if (fabs (e) > t->period) {
+				t->t0 = t->time;
+				t->state = TEMPO_START;
+				break;
+			}
+			t->t0 = t->t1;
+			t->t1 += (t->b * e) + t->period;
+			t->period += t->c * e;
+			break;
+	}
+}
+
+
+// returns TRUE if the estimator is locked on the clock, ie. tempo and predictions are available
+int tempo_locked (tempo_t *t) {
+
+	return (t->state == TEMPO_LOCKED);
+}
+
+
+// smoothed number of samples per tick (0 if not locked)
+double tempo_spt (tempo_t *t) {
+
+	return (t->state == TEMPO_LOCKED) ? t->period : 0.0;
+}
+
+
+// smoothed tempo, in beats (quarter notes) per minute (0 if not locked)
+double tempo_bpm (tempo_t *t) {
+
+	if (t->state != TEMPO_LOCKED) return 0.0;
+	return (60.0 * sample_rate) / (t->period * (ppbar / 4.0));
+}
+
+
+// predicted absolute frame time of the tick which is "ticks" ticks after the last tick (last tick itself if ticks is 0)
+// returns the frame time of the last tick if not locked
+jack_nframes_t tempo_predict (tempo_t *t, int ticks) {
+
+	if (t->state != TEMPO_LOCKED) return t->frame;
+	return t->frame + (jack_nframes_t) (long long) floor ((t->t0 - t->time) + (ticks * t->period) + 0.5);
+}
@@ -0,0 +1,13 @@
+/** @file tempo.h
+ *
+ * @brief This file defines prototypes of functions inside tempo.c
+ *
+ */
+
+void tempo_init (tempo_t *, double);
+void tempo_reset (tempo_t *);
+void tempo_tick (tempo_t *, jack_nframes_t);
+int tempo_locked (tempo_t *);
+double tempo_spt (tempo_t *);
+double tempo_bpm (tempo_t *);
+jack_nframes_t tempo_predict (tempo_t *, int);
@@ -12,65 +12,191 @@
 #include "time.h"
 #include "utils.h"
 #include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
+
+
+// time signatures selected by the time signature pad: default list, which can be replaced in config file (see time_signatures)
+// time signatures of loaded sessions are added to the list if these are not in it
+static int timesign_values [MAX_TIMESIGNS] [2] = {
+	{4, 4},
+	{2, 2},
+	{2, 4},
+	{3, 4},
+	{6, 8},
+	{9, 8},
+	{12, 8},
+	{5, 4}
+};
+static int nb_timesigns = 8;
+
+// tick table of the current time signature: beat and bar boundaries of each tick of a cycle of bars
+// a bar lasts ppbar * numerator / denominator ticks, which is not always a whole number of ticks (eg. 7/64): the table then covers
+// several bars, until bars and ticks are aligned again; table is computed with integers, so there is no drift over thousands of bars
+static time_tick_t time_table [TIME_TABLE];
+static int time_cycle;			// number of ticks of the table
+static int time_bars;			// number of bars of the table
+static int time_position;		// position of the current tick in the table
+
+// song position: bar of the start of the song (last midi play, or time signature change), and position (in ticks) of the next tick after a seek
+static unsigned int song_bar = 1;
+static int seek_position = -1;
+
+
+// greatest common divisor
+static int gcd (int a, int b) {
+
+	int r;
+
+	while (b != 0) {
+		r = a % b;
+		a = b;
+		b = r;
+	}
+
+	return a;
+}
+
+
+// number of 1/denominator notes in a beat: compound time signatures (6/8, 9/8, 12/8...) have dotted beats
+static int beat_notes (int numerator) {
+
+	return ((numerator % 3 == 0) && (numerator > 3)) ? 3 : 1;
+}
 
 
 // function called in case user pressed the time_signature pad
 int change_timesign () {
 
-	// time signatures are sorted in a particular order so it is easy to process
+	// go to next time signature in the list
+	if (++timesign >= nb_timesigns) timesign = FIRST_TIMESIGN;
+
+	// changes time_signature according to the list
+	set_timesign (timesign);
+
+	// new bar at next clock
+	is_BBT = PENDING_ON;
+}
+
+
+// set time signature (numerator, denominator) according to timesign value (index in the list), and compute its tick table
+int set_timesign (int value) {
+
+	int bar_ticks, beat_ticks, t, bar, beat, previous_bar, previous_beat, to_bar, to_beat, bar_start;
+
 	// check boundaries
-	if (++timesign > _5_4) timesign = _4_4;
-
-	// changes time_signature according to predefined values
-	switch (timesign) {
-		case _4_4:
-			BBT_numerator = 4;
-			BBT_denominator = 4;
-			break;
-		case _2_2:
-			BBT_numerator = 2;
-			BBT_denominator = 2;
-			break;
-		case _2_4:
-			BBT_numerator = 2;
-			BBT_denominator = 4;
-			break;
-		case _3_4:
-			BBT_numerator = 3;
-			BBT_denominator = 4;
-			break;
-		case _6_8:
-			BBT_numerator = 6;
-			BBT_denominator = 8;
-			break;
-		case _9_8:
-			BBT_numerator = 9;
-			BBT_denominator = 8;
-			break;
-		case _12_8:
-			BBT_numerator = 12;
-			BBT_denominator = 8;
-			break;
-		case _5_4:
-			BBT_numerator = 5;
-			BBT_denominator = 4;
-			break;
-		default:
-			BBT_numerator = 4;
-			BBT_denominator = 4;
-			break;
+	if ((value < FIRST_TIMESIGN) || (value >= nb_timesigns)) value = FIRST_TIMESIGN;
+	timesign = value;
+
+	// changes time_signature according to the list
+	BBT_numerator = timesign_values [timesign][0];
+	BBT_denominator = timesign_values [timesign][1];
+
+	// lengths are in 1/denominator ticks, so these are integers: a bar is ppbar * numerator, a beat is ppbar * beat_notes
+	// table covers the smallest number of bars which lasts a whole number of ticks
+	bar_ticks = ppbar * BBT_numerator;
+	beat_ticks = ppbar * beat_notes (BBT_numerator);
+	time_cycle = bar_ticks / gcd (bar_ticks, BBT_denominator);
+	time_bars = (time_cycle * BBT_denominator) / bar_ticks;
+
+	// tick t is in bar (t * denominator) / bar_ticks; it starts a bar (or a beat) if tick t-1 is in the previous one
+	previous_bar = -1;
+	previous_beat = -1;
+	bar_start = 0;
+	for (t = 0; t < time_cycle; t++) {
+		bar = (t * BBT_denominator) / bar_ticks;
+		beat = ((t * BBT_denominator) - (bar * bar_ticks)) / beat_ticks;
+		if (bar != previous_bar) bar_start = t;
+		time_table [t].beat = (unsigned char) (beat + 1);
+		time_table [t].flags = (bar != previous_bar) ? (TIME_BAR | TIME_BEAT) : ((beat != previous_beat) ? TIME_BEAT : 0);
+		time_table [t].bar = (unsigned char) bar;
+		time_table [t].tick = (unsigned short) (t - bar_start + 1);
+		previous_bar = bar;
+		previous_beat = beat;
+	}
+
+	// number of ticks to next beat and next bar from each tick (table is cyclic, and its first tick starts a bar)
+	to_bar = 1;
+	to_beat = 1;
+	for (t = time_cycle - 1; t >= 0; t--) {
+		time_table [t].to_bar = (unsigned short) to_bar;
+		time_table [t].to_beat = (unsigned short) to_beat;
+		to_bar = (time_table [t].flags & TIME_BAR) ? 1 : to_bar + 1;
+		to_beat = (time_table [t].flags & TIME_BEAT) ? 1 : to_beat + 1;
+	}
+
+	time_position = 0;
+}
+
+
+// check that a time signature can be used: its bars shall last at least a tick, and its table shall fit in TIME_TABLE
+static int valid_timesign (int numerator, int denominator) {
+
+	if ((numerator < 1) || (numerator > MAX_NUMERATOR) || (denominator < 1) || (denominator > MAX_DENOMINATOR)) return FALSE;
+	return (ppbar * numerator >= denominator);
+}
+
+
+// empty the list of time signatures (before the list of config file is added)
+void clear_timesigns () {
+
+	nb_timesigns = 0;
+}
+
+
+// add a time signature at the end of the list; returns its timesign value, or -1 if it cannot be added
+int add_timesign (int numerator, int denominator) {
+
+	if ((nb_timesigns >= MAX_TIMESIGNS) || !valid_timesign (numerator, denominator)) return -1;
+
+	timesign_values [nb_timesigns][0] = numerator;
+	timesign_values [nb_timesigns][1] = denominator;
+	// value is written before the list grows, as the realtime thread may read the list meanwhile
+	__atomic_store_n (&nb_timesigns, nb_timesigns + 1, __ATOMIC_RELEASE);
+	return nb_timesigns - 1;
+}
+
+
+// get timesign value of a time signature (numerator, denominator) in the list; returns -1 if it is not in the list
+// the list is not changed, so this can be called from the realtime thread
+int lookup_timesign (int numerator, int denominator) {
+
+	int value, count = __atomic_load_n (&nb_timesigns, __ATOMIC_ACQUIRE);
+
+	for (value = FIRST_TIMESIGN; value < count; value++) {
+		if ((timesign_values [value][0] == numerator) && (timesign_values [value][1] == denominator)) return value;
 	}
 
-		// new bar at next clock
-		is_BBT = PENDING_ON;
+	return -1;
+}
+
+
+// get timesign value of a time signature (numerator, denominator): time signature is added to the list if it is not in it
+// returns FIRST_TIMESIGN if time signature is not supported; main thread only, as it may add to the list
+int find_timesign (int numerator, int denominator) {
+
+	int value;
+
+	value = lookup_timesign (numerator, denominator);
+	if (value >= 0) return value;
+
+	value = add_timesign (numerator, denominator);
+	return (value < 0) ? FIRST_TIMESIGN : value;
 }
 
 
 // function called at each tick to progress the number of ticks, beats and bar (BBT)
+// beats and bars are given by the tick table of the time signature
 // returns led to be lit (ON, OFF, PENDING_ON...)
 int time_progress () {
 
-float BBT_beat_value;
 int ret = OFF;
 
 	// process the delay of 4 ticks in the switching on/off of the pad led... this is to make sure hardware can follow the pace
@@ -87,76 +213,51 @@ int ret = OFF;
 
 
 	// check if we should have a new bar (because this is program's start, or play event or sign time change has occured right before
+	// this is the start of the song (song position 0)
 	if (is_BBT == PENDING_ON) {
 		BBT_bar++;
 		BBT_beat = 1;
 		BBT_previous_beat = 1;
-		BBT_tick = 0;		// set to 0 as we are going to increment right after to it becomes 1
+		BBT_tick = 1;
+		time_position = 0;			// first tick of the table is the start of a bar
+		song_bar = BBT_bar;
+		seek_position = -1;
 		BBT_wait_4_ticks = 8;		// purpose of this is to delay switch on/off of led of about 4 clock ticks, so hardware can support it
 		is_BBT = ON;		// indicates we have a new bar
 		ret = ON;			// return value which could be used to set leds
+		return ret;
 	}
 	else is_BBT = OFF;		// init as "no new bar", and we are going to calculate afterwards if new bar
 
-	// process BBT according to time signature and tick counter
-	// compute tick value
-	BBT_tick++;
-	// compute beat value
-	BBT_beat_value = (float) ppbar / (float) BBT_denominator;		// float value
-
-
-	// compute beat based on numerator time signature
-	switch (BBT_numerator) {
-		case 1:
-		case 2:
-		case 3:
-		case 4:
-		case 5:
-			// simple time signature
-			BBT_beat = (int) (((BBT_tick-1) / BBT_beat_value))+1;
-
-			// check if we changed beat
-			if (BBT_beat != BBT_previous_beat) {
-				ret = PENDING_ON;			// return value which could be used to set leds
-				BBT_previous_beat = BBT_beat;
-				BBT_wait_4_ticks = 4;		// purpose of this is to delay switch on/off of led of about 4 clock ticks, so hardware can support it
-			}
-
-			/* check if we changed bar */
-			if (BBT_beat > BBT_numerator) {
-				BBT_bar++;
-				BBT_beat = 1;
-				BBT_previous_beat = 1;
-				BBT_tick = 1;
-				BBT_wait_4_ticks = 8;		// purpose of this is to delay switch on/off of led of about 4 clock ticks, so hardware can support it
-				is_BBT = ON;		// indicates we have a new bar
-				ret = ON;			// return value which could be used to set leds
-			}
-			break;
-		case 6:
-		case 9:
-		case 12:
-			/* compound time signature */
-			BBT_beat = (int) ((BBT_tick-1) / (BBT_beat_value*3))+1;
-
-			/* check if we changed beat */
-			if (BBT_beat != BBT_previous_beat) {
-				ret = PENDING_ON;			// return value which could be used to set leds
-				BBT_previous_beat = BBT_beat;
-				BBT_wait_4_ticks = 4;		// purpose of this is to delay switch on/off of led of about 4 clock ticks, so hardware can support it
-			}
-
-			/* check if we change bar */
-			if (BBT_beat*3 > BBT_numerator) {
-				BBT_bar++;
-				BBT_beat = 1;
-				BBT_previous_beat = 1;
-				BBT_tick = 1;
-				BBT_wait_4_ticks = 8;		// purpose of this is to delay switch on/off of led of about 4 clock ticks, so hardware can support it
-				is_BBT = ON;		// indicates we have a new bar
-				ret = ON;			// return value which could be used to set leds
-			}
-			break;
+	// song position has changed (song position pointer): this tick is at the new position, whose bar, beat and tick are given by the tick table
+	if (seek_position >= 0) {
+		time_position = seek_position % time_cycle;
+		BBT_bar = song_bar + ((seek_position / time_cycle) * time_bars) + time_table [time_position].bar;
+		BBT_tick = time_table [time_position].tick;
+		BBT_previous_beat = time_table [time_position].beat;
+		seek_position = -1;
+	}
+	// next tick of the table
+	else {
+		if (++time_position >= time_cycle) time_position = 0;
+		BBT_tick++;
+		if (time_table [time_position].flags & TIME_BAR) BBT_bar++;
+	}
+	BBT_beat = time_table [time_position].beat;
+
+	/* check if we changed bar */
+	if (time_table [time_position].flags & TIME_BAR) {
+		BBT_previous_beat = 1;
+		BBT_tick = 1;
+		BBT_wait_4_ticks = 8;		// purpose of this is to delay switch on/off of led of about 4 clock ticks, so hardware can support it
+		is_BBT = ON;		// indicates we have a new bar
+		ret = ON;			// return value which could be used to set leds
+	}
+	// check if we changed beat
+	else if (time_table [time_position].flags & TIME_BEAT) {
+		ret = PENDING_ON;			// return value which could be used to set leds
+		BBT_previous_beat = BBT_beat;
+		BBT_wait_4_ticks = 4;		// purpose of this is to delay switch on/off of led of about 4 clock ticks, so hardware can support it
 	}
 
 //printf ("bar: %d, beat:%d, tick:%d\n", BBT_bar, BBT_beat, BBT_tick);
@@ -165,3 +266,32 @@ int ret = OFF;
 }
 
 
+
+
+// song position pointer: the next tick is at "position" (in ticks from the start of the song)
+void time_seek (int position) {
+
+	seek_position = (position < 0) ? 0 : position;
+}
+
+
+// predicted absolute frame time of the next beat, given by the tempo estimator
+jack_nframes_t time_next_beat () {
+
+	return tempo_predict (&tempo, time_table [time_position].to_beat);
+}
+
+
+// predicted absolute frame time of the next bar, given by the tempo estimator
+jack_nframes_t time_next_bar () {
+
+	return tempo_predict (&tempo, time_table [time_position].to_bar);
+}
+
+
+// exact length (in samples) of "bars" bars, according to time signature and tempo estimator; returns 0 if tempo is not known
+jack_nframes_t time_bars_length (int bars) {
+
+	if ((bars <= 0) || !tempo_locked (&tempo)) return 0;
+	return (jack_nframes_t) floor (((double) bars * ppbar * BBT_numerator * tempo_spt (&tempo) / BBT_denominator) + 0.5);
+}
@@ -5,4 +5,13 @@
  */
 
 int change_timesign ();
+int set_timesign (int);
+int lookup_timesign (int, int);
+int find_timesign (int, int);
+void clear_timesigns ();
+int add_timesign (int, int);
 int time_progress ();
+void time_seek (int);
+jack_nframes_t time_next_beat ();
+jack_nframes_t time_next_bar ();
+jack_nframes_t time_bars_length (int);
@@ -16,20 +16,29 @@
 #endif
 #include <jack/jack.h>
 #include <jack/midiport.h>
+#include <jack/ringbuffer.h>
 #include <libconfig.h>
+#include <pthread.h>
+#include <semaphore.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
 
 
 /* constants */
-#define NB_TRACKS	4	// number of tracks for the looper
+#define NB_TRACKS	4	// default number of tracks for the looper; this can be changed in config file or in command line
+#define MAX_TRACKS	32	// max number of tracks for the looper (tracks are handled as bit masks in the mix engine)
 #define NB_BAR_ROWS 2	// number of bar rows to select tehe number of bars to record
 #define MIDI_SYSEX	0xF0
+#define MIDI_SPP 0xF2			// song position pointer: position in 1/16 notes (14 bits, lsb first)
 #define MIDI_CLOCK 0xF8
 #define MIDI_RESERVED 0xF9
 #define MIDI_PLAY 0xFA
+#define MIDI_CONTINUE 0xFB
 #define MIDI_STOP 0xFC
 //#define MIDI_CLOCK_RATE_MATRIBOX 99.0	// Matribox II is not standard
-#define MIDI_CLOCK_RATE 96.0 			// 24*4 ticks for full note, 24 ticks per quarter note
+#define MIDI_CLOCK_RATE 96 			// 24*4 ticks for full note, 24 ticks per quarter note
 
 #define FIRST_ELT 0		// used for declarations and loops
 #define TIMESIGN 0
@@ -43,27 +52,94 @@
 #define VOLUP 8
 #define MODE 9
 #define DELETE 10
-#define LAST_ELT 11		// used for declarations and loops
+#define STRETCH 11
+#define TAP 12
+#define LAST_ELT 13		// used for declarations and loops
 
 #define LAST_BAR_ELT 8		// used for declarations and loops
 
+/* dispatch table of the controls: action of each midi event (status, data 1), built from config file */
+#define CONTROLS 65536		// number of entries of the table (one for each status and data 1)
+#define CTRL_NONE 0			// midi event has no action
+#define CTRL_TRACK 1		// function of a track (or global function of track 1: time signature, load, save, tap)
+#define CTRL_BAR 2			// pad of a bar row
+
 
 /* max number of samples of each track buffer (L,R) */
 #define NB_SAMPLES	13230000	// 13230000 samples at 44100 Hz means 300 seconds of music, ie. 5 min loops
 								// 13230000 samples at 48000 Hz means 275 seconds of music, ie. 4.5 min loops
 
-/* time signature values */
+/* number of samples of the crossfade between the end and the start of a loop (anti crack) */
+#define CROSSFADE 8
+
+/* audio pool: track buffers are tables of blocks of POOL_BLOCK samples, which are taken from the pool when recording */
+#define POOL_BLOCK_SHIFT 15
+#define POOL_BLOCK (1 << POOL_BLOCK_SHIFT)			// number of samples in a block (32768 samples, ie. 128 KB)
+#define POOL_BLOCK_MASK (POOL_BLOCK - 1)
+#define NB_BLOCKS ((NB_SAMPLES >> POOL_BLOCK_SHIFT) + 2)	// max number of blocks of each track buffer (L,R), with some more room to avoid overflows
+#define POOL_SIZE 256								// default size of the audio pool, in MB (256 MB is about 11 min of stereo audio at 48000 Hz)
+#define POOL_RT_BLOCKS 64							// number of free blocks that are always available to the realtime thread
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)				// size of a huge page (used to round the size of the audio pool)
+
+/* huge pages used by the audio pool */
+#define HUGEPAGES_OFF 0								// standard pages
+#define HUGEPAGES_TRANSPARENT 1						// transparent huge pages (kernel gives huge pages if possible)
+#define HUGEPAGES_EXPLICIT 2						// explicit huge pages (shall be reserved in /proc/sys/vm/nr_hugepages)
+
+/* time signatures: the time signature pad selects the next time signature of a list (see time_signatures in config file) */
 #define FIRST_TIMESIGN 0
-#define _4_4 0
-#define _2_2 1
-#define	_2_4 2
-#define	_3_4 3
-#define	_6_8 4
-#define	_9_8 5
-#define	_12_8 6
-#define	_5_4 7
-#define LAST_TIMESIGN 7
-// let's not support 3_8 nor 6_4 for now at it messes with our BBT calculations algorithm
+#define MAX_TIMESIGNS 16		// max number of time signatures in the list
+#define MAX_NUMERATOR 32		// max numerator of a time signature
+#define MAX_DENOMINATOR 64		// max denominator of a time signature
+#define MAX_PPBAR 192			// max number of clock ticks per whole note
+#define TIME_TABLE (MAX_PPBAR * MAX_NUMERATOR)	// max number of ticks of the tick table of a time signature (see time.c)
+#define TIME_BAR 1				// tick starts a bar (tick table flags)
+#define TIME_BEAT 2				// tick starts a beat
+
+/* tempo estimator (delay-locked loop on midi clock ticks) */
+#define TEMPO_OFF 0				// no tick received yet
+#define TEMPO_START 1			// one tick received: period not known yet
+#define TEMPO_LOCKED 2			// tempo and predictions are available
+#define TEMPO_BANDWIDTH 0.01	// bandwidth of the loop, relative to the tick rate (0.5 Hz at 120 bpm)
+
+/* clock sources (see clock in config file) */
+#define CLOCK_MIDI 0			// midi clock on clock input port
+#define CLOCK_TRANSPORT 1		// JACK transport
+#define CLOCK_INTERNAL 2		// internal clock, at the tempo given by bpm (or by the tap pad)
+#define TIMEBASE_TICKS 1920.0	// ticks per beat given to the JACK transport, when boocli is timebase master
+#define MASTER_BPM 120.0		// default tempo, when boocli is the clock master
+#define MIN_BPM 20.0			// min tempo of the clock master
+#define MAX_BPM 300.0			// max tempo of the clock master
+#define TAP_COUNT 4				// number of intervals between taps which are averaged to get the tempo of the tap pad
+
+/* midi clock inputs: one of the inputs is the active clock, with failover to the other inputs, and freewheel if they are all lost */
+#define CLOCK_INPUTS 4			// max number of clock input ports
+#define CLOCK_FREEWHEEL -1		// no active input: clock goes on at the last tempo (or is idle, if not running)
+#define CLOCK_DROPOUT 2.0		// an input is lost if it has not ticked for this number of ticks
+#define CLOCK_TIMEOUT 0.5		// same, in seconds, while the tempo of the input is not known yet
+#define CLOCK_JITTER 0.1		// max jitter of a good input, relative to its tick period
+#define CLOCK_RECOVER 96		// number of regular ticks before an input is good again (1 bar in 4/4, at default ppbar)
+#define CLOCK_SMOOTH 0.05		// smoothing of the jitter measure
+#define INPUT_IDLE 0			// no clock on the input (or lost)
+#define INPUT_RUNNING 1			// input is ticking
+#define INPUT_STOPPED 2			// midi stop has been received on the input
+
+/* playback resampling, to follow the tempo of the clock (see resample in config file) */
+#define RESAMPLE_MIN 0.8		// min playback rate (ratio of the tempo of the clock to the tempo of the recording)
+#define RESAMPLE_MAX 1.25		// max playback rate
+#define RESAMPLE_DEADBAND 1e-4	// playback rates closer to 1 than this are played without resampling (plain copy)
+#define RESAMPLE_SMOOTH 0.02	// smoothing of the playback rate at each cycle (one-pole filter on the tempo estimator)
+#define RESAMPLE_SLEW 5e-4		// max change of the playback rate at each cycle
+
+/* time-stretch (WSOLA): a track is rendered again to the bar length of the current tempo by worker threads, then swapped at next bar */
+#define STRETCH_WINDOW 1024			// length of the frames which are overlapped and added (about 21 ms at 48000 Hz)
+#define STRETCH_HOP (STRETCH_WINDOW / 2)	// distance between 2 frames in the stretched track
+#define STRETCH_TOLERANCE 384		// max shift of a frame from its nominal position, to find the best match with the previous frame
+#define STRETCH_COMPARE 512			// number of samples compared to find the best match (overlap of 2 frames)
+#define STRETCH_DECIMATE 4			// step of the coarse search of the best match, which is then refined around the best coarse match
+#define STRETCH_MIN 0.5				// min stretch ratio (new length of the track to its length)
+#define STRETCH_MAX 2.0				// max stretch ratio
+#define STRETCH_THREADS 8			// max number of worker threads (one per core)
 
 /* define status, etc */
 #define TRUE 1
@@ -82,7 +158,83 @@
 #define LAST_STATE 4		// used for declarations and loops
 
 /* list management (used for led mgmt) */
-#define LIST_ELT 100
+#define LED_UNKNOWN 0xFF	// state of a led before anything has been sent to it
+#define LED_RATE 1000		// default maximum number of led messages per second sent to the control surface (midi DIN carries about 1000 messages of 3 bytes per second)
+#define LED_MIDI 0			// led output: one midi message for each led
+#define LED_LAUNCHPAD 1		// led output: leds of a cycle gathered in a bulk SysEx message (Launchpad "set leds")
+#define LED_PAIRS 80		// maximum number of (led, colour) pairs in a bulk SysEx message, ie. leds sent in a cycle
+#define LED_SYSEX 16		// maximum size of the header of the bulk SysEx message (after 0xF0)
+
+/* commands sent from realtime thread to main thread (slow operations) */
+#define FIRST_CMD 0		// used for declarations and loops
+#define CMD_LOAD 0
+#define CMD_SAVE 1
+#define CMD_RECYCLE 2	// give audio buffers of shadow tracks back to the audio pool, once these have been swapped
+#define CMD_STRETCH 3	// time-stretch a track to the bar length of the current tempo
+#define CMD_UNSTRETCH 4	// give previous audio buffers of a stretched track back to the audio pool, once these have been swapped
+#define FIRST_NOTIFY 5	// commands from FIRST_NOTIFY are notifications: these can be sent several times, and main thread does not reply
+#define CMD_UNMAP 5		// unmap a session file which is no longer used by a track (mmap mode)
+#define LAST_CMD 6		// used for declarations and loops
+#define COMMAND_ELT 64	// number of commands (or replies) in the command queue
+
+/* messages of the realtime thread: sent through a lock-free ring, and written to stderr by the logger thread */
+#define FIRST_LOG 0				// used for declarations and loops
+#define LOG_MISSED_EVENT 0		// midi event of a port cannot be read (text: name of the port)
+#define LOG_MISSED_CLOCK 1		// midi clock event cannot be read
+#define LOG_CLOCK_INPUT 2		// new clock input (arg: clock input)
+#define LOG_FREEWHEEL 3			// all the clock inputs are lost (value: tempo)
+#define LOG_POOL_EXHAUSTED 4	// no more free block in the audio pool
+#define LOG_SUPPRESSED 5		// summary of the messages of a type which have not been logged (arg: type)
+#define LAST_LOG 6				// used for declarations and loops
+#define LOG_ELT 64				// number of messages in the log ring
+#define LOG_BURST 4				// max number of messages of a type logged per second; the other ones are counted, and reported in a summary
+
+/* timing statistics of the realtime thread, published in a shared memory block (read by boocli_stats) */
+#define STATS_SHM "/boocli.stats"	// name of the shared memory block
+#define STATS_MAGIC 0x54534F42		// "BOST"
+#define STATS_VERSION 1
+#define FIRST_STAGE 0		// used for declarations and loops
+#define STAGE_CYCLE 0		// whole process callback
+#define STAGE_COMMAND 1		// replies of the main thread
+#define STAGE_MIDI 2		// midi in and clock events
+#define STAGE_PLAY 3		// playback and mix of the tracks (including clipping of audio out)
+#define STAGE_RECORD 4		// recording of the tracks
+#define STAGE_CLIP 5		// clipping of audio out, when no track is mixed
+#define STAGE_LED 6			// led output
+#define LAST_STAGE 7		// used for declarations and loops
+#define STATS_BINS 16		// histogram of the time of a stage: bin k counts the cycles where it took 2^k to 2^(k+1) us (bin 0: less than 2 us)
+#define STATS_XRUNS 16		// number of xruns kept in the stats block (the last ones)
+
+/* session files: metadata is in SAVE_FILE, audio of each track in SAVE_FILE.n (or TAKE_FILE.n while it is being recorded) */
+/* all the fields of session files are 32 bits little endian integers */
+#define SAVE_FILE "./boocli.sav"
+#define TAKE_FILE "./boocli.take"
+#define SESSION_MAGIC 0x534F4F42	// "BOOS": session (metadata) file
+#define TRACK_MAGIC 0x544F4F42		// "BOOT": track audio file
+#define SESSION_VERSION 2			// current version of session files; older versions shall remain readable (version 2: tempo of the tracks)
+#define SESSION_HEADER 8			// number of fields in the header of session file, before the track entries
+#define TRACK_ENTRY 8				// number of fields of each track entry in session file
+#define TRACK_ENTRY_MIN 7			// number of fields of each track entry in version 1 of session file (readers require at least these)
+#define TRACK_HEADER 4096			// size of the header of track audio files (one page: audio chunks are page aligned, so files can be mapped)
+#define TRACK_FIELDS 10				// number of fields in the header of track audio files, before the checksums of the blocks
+#define MAX_MAPS (3 * MAX_TRACKS)	// max number of session files mapped at the same time (tracks, shadow tracks, and files being unmapped)
+#define LEFT_OFFSET ((off_t) TRACK_HEADER)	// offset of left samples in track audio files
+#define RIGHT_OFFSET ((off_t) TRACK_HEADER + (off_t) NB_BLOCKS * POOL_BLOCK * sizeof (jack_default_audio_sample_t))	// offset of right samples in track audio files
+
+/* write-behind recorder: records sent from realtime thread to writer thread */
+#define REC_START 0		// new take
+#define REC_DATA 1		// recorded samples
+#define REC_END 2		// end of take
+#define REC_LOADED 3	// track has been loaded from session files
+#define REC_CHANGED 4	// audio of the track has been changed in memory (time-stretch): it is neither in take file nor in session file
+#define RECORDER_SECONDS 4	// size of the recorder ring, in seconds of stereo audio
+
+/* take states (where the audio of a track is on disk) */
+#define TAKE_NONE 0			// nowhere
+#define TAKE_RECORDING 1	// being recorded in take file
+#define TAKE_COMPLETE 2		// complete in take file
+#define TAKE_DROPPED 3		// take file is incomplete (audio has been dropped): track shall be saved from memory
+#define TAKE_SAVED 4		// in session file
 
 /* types */
 typedef struct {						// structure for each of the 8 tracks
@@ -109,16 +261,109 @@ typedef struct {						// structure for each of the 8 tracks
 
 	float volume;				// volume of the track, between 0 and 1 (by 0.1 increments)
 
+	double play_frac_left;				// fractional part of the play position, when resampling (left)
+	double play_frac_right;				// fractional part of the play position, when resampling (right)
+	double record_spt;					// tempo of the recording, in samples per tick (0 if unknown)
+	double play_ratio;					// smoothed playback rate when resampling (0 if not known yet: it then starts at the rate of the clock)
 	jack_default_audio_sample_t last_sample_left;	// last sample played for last frame played (left)
 	jack_default_audio_sample_t last_sample_right;	// last sample played for last frame played (right)
 
-	jack_default_audio_sample_t *left;	// audio buffer (left)
-	jack_default_audio_sample_t *right;	// audio buffer (right)
+	jack_default_audio_sample_t **left;	// audio buffer (left): table of NB_BLOCKS blocks taken from the audio pool (NULL if block not used)
+	jack_default_audio_sample_t **right;	// audio buffer (right): table of NB_BLOCKS blocks taken from the audio pool (NULL if block not used)
+	int map;							// in mmap mode, number of the mapping of the track audio file if blocks point into the file (0 if blocks come from the audio pool)
+	unsigned int generation;			// incremented each time the audio of the track is replaced (record, delete, load, stretch)
 
 } track_t;
 
+typedef struct {						// tick of the tick table of a time signature
+	unsigned char beat;					// beat of the tick in its bar (from 1)
+	unsigned char flags;				// TIME_BAR, TIME_BEAT
+	unsigned char bar;					// bar of the tick in the table (from 0)
+	unsigned short tick;				// tick in its bar (from 1)
+	unsigned short to_beat;				// number of ticks to the next beat
+	unsigned short to_bar;				// number of ticks to the next bar
+} time_tick_t;
+
 typedef struct {						// structure for each of the 2 lines of bar selectors
 	unsigned char ctrl [LAST_BAR_ELT] [2];	//controls on the midi control surface
 	unsigned char led [LAST_BAR_ELT] [LAST_STATE] [3];		// led lightings on the midi control surface (off, pending on, on, pending off...)
 	unsigned char status [LAST_BAR_ELT];	// Status byte for each function
 } bar_t;
+
+typedef struct {						// action of a midi control, in the dispatch table of the controls
+	unsigned char type;					// CTRL_NONE, CTRL_TRACK or CTRL_BAR
+	unsigned char num;					// track number, or bar row
+	unsigned char elt;					// function of the track (PLAY, RECORD...), or pad of the bar row
+} control_t;
+
+typedef struct {						// command sent from realtime thread to main thread, or reply from main thread to realtime thread
+	int type;							// command type (CMD_LOAD, CMD_SAVE...)
+	int arg;							// command argument, if any
+} command_t;
+
+typedef struct {						// message sent from realtime thread to logger thread; it is formatted by logger thread
+	int type;							// message type (LOG_MISSED_EVENT...)
+	int arg;							// message argument, if any
+	double value;						// message value, if any
+	const char *text;					// message text, if any: shall be a string constant
+	unsigned int count;					// LOG_SUPPRESSED: number of messages which have not been logged
+	unsigned int total;					// number of messages of this type since startup
+} log_t;
+
+typedef struct {						// timing statistics of a stage of the process callback (times in ns)
+	unsigned int last;					// time of the stage in the last cycle
+	unsigned int min;
+	unsigned int max;
+	unsigned long long sum;				// sum of the times of all the cycles, for the average
+	unsigned int histogram [STATS_BINS];
+} stage_stats_t;
+
+typedef struct {						// xrun, with the worst times of the stages in the cycles before it was reported
+	unsigned long long cycle;			// cycle where the xrun has been reported
+	float delay;						// delay reported by JACK, in us
+	unsigned int worst [LAST_STAGE];	// worst time of each stage in the last 1 to 2 seconds, in ns
+} xrun_stats_t;
+
+typedef struct {						// shared memory block of the timing statistics
+	unsigned int magic;					// STATS_MAGIC
+	unsigned int version;				// STATS_VERSION
+	unsigned int sequence;				// incremented before and after each update: odd while realtime thread is writing the block
+	unsigned int sample_rate;
+	unsigned int nframes;				// frames per cycle
+	unsigned int nb_tracks;
+	unsigned long long cycles;			// number of cycles measured
+	unsigned int tracks;				// number of tracks playing or recording in the last cycle
+	unsigned int tracks_max;			// max number of tracks playing or recording in a cycle
+	unsigned int xruns;					// number of xruns since startup
+	stage_stats_t stage [LAST_STAGE];
+	xrun_stats_t xrun [STATS_XRUNS];	// last xruns: xrun n (from 0) is in xrun [n % STATS_XRUNS]
+} stats_t;
+
+typedef struct {						// tempo estimator of a clock source (see tempo.c)
+	int state;							// TEMPO_OFF, TEMPO_START or TEMPO_LOCKED
+	jack_nframes_t frame;				// absolute frame time of the last tick
+	double time;						// time of the last tick, unwrapped (in frames, from the first tick)
+	double t0;							// filtered time of the last tick
+	double t1;							// predicted time of the next tick
+	double period;						// filtered period of the ticks (samples per tick)
+	double b, c;						// coefficients of the loop
+} tempo_t;
+
+typedef struct {						// midi clock input, watched by the arbitration of the clock inputs (see clock.c)
+	int state;							// INPUT_IDLE, INPUT_RUNNING or INPUT_STOPPED
+	tempo_t tempo;						// tempo estimator of the input
+	jack_nframes_t frame;				// absolute frame time of the last tick (or play)
+	double jitter;						// smoothed error between the ticks and their predicted time, in frames
+	int ticks;							// number of regular ticks since the tempo of the input is known
+	void *buffer;						// events of the input during the cycle
+	jack_nframes_t index, count;
+} clock_input_t;
+
+typedef struct {						// record sent from realtime thread to writer thread; for REC_DATA, left then right samples follow
+	int type;							// record type (REC_START, REC_DATA...)
+	int tracknum;						// track number
+	jack_nframes_t index;				// position of the samples in the take
+	jack_nframes_t nframes;				// number of samples (for each channel)
+	int arg;							// record argument, if any
+	unsigned int take;					// take of the track the record belongs to (see recorder.c)
+} record_t;
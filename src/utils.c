@@ -13,58 +13,199 @@
 #include "time.h"
 #include "utils.h"
 #include "disk.h"
+#include "mix.h"
+#include "pool.h"
+#include "command.h"
+#include "recorder.h"
+#include "tempo.h"
+#include "stretch.h"
+#include "clock.h"
+#include "logger.h"
+#include "stats.h"
 
 
-// add led request to the list of requests to be processed
-int push_to_list (int dest, int tracknum, int type, int on_off) {
+// allocate all the structures of the tracks, once the number of tracks (nb_tracks) is known
+int init_tracks () {
+
+	int i;
+
+	/* allocate track structures, led status and list of led requests for all the tracks */
+	track = calloc (nb_tracks, sizeof (track_t));
+	shadow = calloc (nb_tracks, sizeof (track_t));
+	saved = calloc (nb_tracks, sizeof (track_t));
+	led_status = calloc (nb_tracks, sizeof (*led_status));
+	list_size = nb_tracks * LAST_ELT + NB_BAR_ROWS * LAST_BAR_ELT;
+	list_buffer = calloc (list_size, sizeof (*list_buffer));
+	list_queued = calloc (list_size, sizeof (*list_queued));
+	list_sent = malloc (list_size * sizeof (*list_sent));
+	if ((track == NULL) || (shadow == NULL) || (saved == NULL) || (led_status == NULL) || (list_buffer == NULL) || (list_queued == NULL) || (list_sent == NULL)) {
+		fprintf ( stderr, "error in creating track structures.\n");
+		exit ( 1 );
+	}
 
-	// add to list
-	list_buffer [list_index][0] = (unsigned char) dest;
-	list_buffer [list_index][1] = (unsigned char) tracknum;
-	list_buffer [list_index][2] = (unsigned char) type;
-	list_buffer [list_index][3] = (unsigned char) on_off;
-
-	// increment index and check boundaries
-	//list_index = (list_index >= LIST_ELT) ? 0; list_index++;
-	if (list_index >= LIST_ELT) {
-		fprintf ( stderr, "too many led requests in the list.\n" );
-		list_index = 0;
+	/* nothing has been sent to the leds yet */
+	memset (list_sent, LED_UNKNOWN, list_size * sizeof (*list_sent));
+
+	/* clear structure that will get control details, ie. track structure */
+	for (i = 0; i<nb_tracks; i++) {
+		/* set volume to 1 for each track */
+		track [i].volume = 1.0f;
+
+		/* for each track, create empty audio buffers: blocks are taken from the audio pool when recording */
+		track [i].left = pool_buffer ();
+		track [i].right = pool_buffer ();
+		/* same for shadow tracks, used when loading a session */
+		shadow [i].left = pool_buffer ();
+		shadow [i].right = pool_buffer ();
+		/* and for saved tracks, which get a copy of the block tables of the tracks */
+		saved [i].left = pool_buffer ();
+		saved [i].right = pool_buffer ();
 	}
-	else list_index++;
+
+	return 0;
 }
 
 
-// pull out led request from the list of requests to be processed (FIFO style)
+// number of a led in the ring of led requests: leds of the tracks first, then leds of the bar rows
+static int led_key (int dest, int tracknum, int type) {
+
+	if (dest == TRACK) return tracknum * LAST_ELT + type;
+	return nb_tracks * LAST_ELT + tracknum * LAST_BAR_ELT + type;
+}
+
+
+// add led request to the ring of requests to be processed; a led which already has a request in the ring keeps its place
+// the state sent is read when the request is pulled out, so the last state wins; returns 0 if the led had a request already
+int push_to_list (int dest, int tracknum, int type, int on_off) {
+
+	int key = led_key (dest, tracknum, type);
+
+	if (list_queued [key]) return 0;
+
+	list_buffer [(list_read + list_count) % list_size] = (unsigned short) key;
+	list_queued [key] = 1;
+	list_count++;
+	return 1;
+}
+
+
+// pull out led request from the ring of requests to be processed (FIFO style), with the current state of the led
+// requests which would not change the state of the led on the control surface are dropped
 // returns 0 if pull request has failed (nomore request to be pulled out)
 int pull_from_list (int *dest, int *tracknum, int *type, int *on_off) {
 
-	// check if we have requests to be pulled; if not, leave
-	if (list_index == 0) return 0;
+	int key;
 
-	// remove first element from list
-	*dest = list_buffer [0][0];
-	*tracknum = list_buffer [0][1];
-	*type = list_buffer [0][2];
-	*on_off = list_buffer [0][3];
+	while (list_count > 0) {
+		// remove first element from ring
+		key = list_buffer [list_read];
+		list_read = (list_read + 1) % list_size;
+		list_count--;
+		list_queued [key] = 0;
 
-	// decrement index
-	list_index--;
+		if (key < nb_tracks * LAST_ELT) {
+			*dest = TRACK;
+			*tracknum = key / LAST_ELT;
+			*type = key % LAST_ELT;
+			*on_off = led_status [*tracknum][*type];
+		}
+		else {
+			*dest = BAR;
+			*tracknum = (key - nb_tracks * LAST_ELT) / LAST_BAR_ELT;
+			*type = (key - nb_tracks * LAST_ELT) % LAST_BAR_ELT;
+			*on_off = bar_led_status [*tracknum][*type];
+		}
 
-	// move the rest of the list 1 item backwards
-	memmove (&list_buffer[0][0], &list_buffer[1][0], list_index * 4);
+		// the led may have gone back to the state it has on the control surface since the request was pushed
+		if (list_sent [key] == *on_off) continue;
+		list_sent [key] = (unsigned char) *on_off;
+		return 1;
+	}
 
-	return 1;
+	return 0;
 }
 
 
-// determines if 2 midi messages (ie. events) are the same; returns 1 if yes
-int same_event (unsigned char * evt1, unsigned char * evt2) {
+// add again the request of a led whose midi message could not be sent; the led will be sent whatever its state
+int retry_list (int dest, int tracknum, int type) {
+
+	list_sent [led_key (dest, tracknum, type)] = LED_UNKNOWN;
+	return push_to_list (dest, tracknum, type, 0);
+}
+
+
+// dispatch table of the controls: action of each midi event (status, data 1) of the control surface
+static control_t *controls = NULL;
+
+
+// add a control to the dispatch table; a control which is already used by another function is reported, and ignored
+static int add_control (unsigned char *event, int type, int num, int elt) {
+
+	// names of the functions, as in config file
+	static const char *names [LAST_ELT] = {"time", "load", "save", "play", "record", "mute", "solo", "voldown", "volup", "mode", "delete", "stretch", "tap"};
+	control_t *c;
+
+	// no control set for this function (midi events start with a status byte)
+	if (event[0] < 0x80) return 0;
 
-	if ((evt1[0]==evt2[0]) && (evt1[1]==evt2[1])) return 1;
+	c = &controls [(event[0] << 8) | event[1]];
+	if (c->type != CTRL_NONE) {
+		fprintf ( stderr, "control (0x%02X, 0x%02X) of ", event[0], event[1] );
+		if (type == CTRL_TRACK) fprintf ( stderr, "%s of track %d", names [elt], num + 1 );
+		else fprintf ( stderr, "bar%d of bar row %d", elt + 1, num + 1 );
+		fprintf ( stderr, " is already used by " );
+		if (c->type == CTRL_TRACK) fprintf ( stderr, "%s of track %d: ignored.\n", names [c->elt], c->num + 1 );
+		else fprintf ( stderr, "bar%d of bar row %d: ignored.\n", c->elt + 1, c->num + 1 );
+		return 1;
+	}
+
+	c->type = type;
+	c->num = num;
+	c->elt = elt;
 	return 0;
 }
 
 
+// build the dispatch table of the controls from the controls of the tracks and bar rows (read in config file); returns the number of duplicate controls
+// the midi events of the control surface then get their action with a single lookup (see find_control)
+int build_controls () {
+
+	int i, j, duplicates = 0;
+
+	if (controls == NULL) controls = calloc (CONTROLS, sizeof (control_t));
+	if (controls == NULL) {
+		fprintf ( stderr, "error in creating control table.\n" );
+		exit ( 1 );
+	}
+	memset (controls, 0, CONTROLS * sizeof (control_t));
+
+	// global functions are the ones of track 1 only
+	duplicates += add_control (track[0].ctrl[TIMESIGN], CTRL_TRACK, 0, TIMESIGN);
+	duplicates += add_control (track[0].ctrl[TAP], CTRL_TRACK, 0, TAP);
+	duplicates += add_control (track[0].ctrl[LOAD], CTRL_TRACK, 0, LOAD);
+	duplicates += add_control (track[0].ctrl[SAVE], CTRL_TRACK, 0, SAVE);
+
+	// functions of each track
+	for (i = 0; i < nb_tracks; i++) {
+		for (j = PLAY; j <= STRETCH; j++) duplicates += add_control (track[i].ctrl[j], CTRL_TRACK, i, j);
+	}
+
+	// pads of the bar rows
+	for (i = 0; i < NB_BAR_ROWS; i++) {
+		for (j = 0; j < LAST_BAR_ELT; j++) duplicates += add_control (bar[i].ctrl[j], CTRL_BAR, i, j);
+	}
+
+	return duplicates;
+}
+
+
+// get the action of a midi event of the control surface (status, data 1)
+control_t *find_control (unsigned char *event) {
+
+	return &controls [(event[0] << 8) | event[1]];
+}
+
+
 // get a status, process state machine with 4 states and returns next status
 unsigned char next_status_4 (unsigned char status) {
 
@@ -105,3 +246,32 @@ int reset_status (track_t *t) {
 }
 
 
+
+
+// crc32 table (polynomial 0xEDB88320, as in zlib), used by checksums of session files
+static unsigned int crc_table [256];
+
+
+// compute crc32 table; shall be called once at startup, before any checksum is computed
+void crc_init () {
+
+	unsigned int c;
+	int n, k;
+
+	for (n = 0; n < 256; n++) {
+		c = (unsigned int) n;
+		for (k = 0; k < 8; k++) c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+		crc_table [n] = c;
+	}
+}
+
+
+// update crc32 "crc" with "length" bytes of data (crc shall be 0 for the first call)
+unsigned int crc32 (unsigned int crc, const void *data, size_t length) {
+
+	const unsigned char *p = data;
+
+	crc = ~crc;
+	while (length--) crc = crc_table [(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
@@ -4,10 +4,15 @@
  *
  */
 
+int init_tracks ();
 int push_to_list (int, int , int , int);
 int pull_from_list (int *, int *, int *, int *);
-int same_event (unsigned char *, unsigned char *);
+int retry_list (int, int, int);
+int build_controls ();
+control_t *find_control (unsigned char *);
 unsigned char next_status_4 (unsigned char);
 unsigned char next_status_2 (unsigned char);
 int is_pending_action (int);
 int reset_status (track_t *);
+void crc_init ();
+unsigned int crc32 (unsigned int, const void *, size_t);